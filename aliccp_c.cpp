@@ -0,0 +1,195 @@
+#include "aliccp_c.h"
+#include "aliccp_reader.h"
+#include "aliccp_shard.h"
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+
+struct aliccp_reader_t
+{
+    std::unique_ptr<aliccp::Reader> rep;
+};
+
+struct aliccp_batch_t
+{
+    aliccp::Batch rep;
+};
+
+static bool
+save_error(char** errptr, rocksdb::Status const& status)
+{
+    if (status.ok()) {
+        return false;
+    }
+
+    if (errptr) {
+        free(*errptr);
+        *errptr = strdup(status.ToString().c_str());
+    }
+    return true;
+}
+
+static aliccp::OutputBuffers
+to_output_buffers(aliccp_output_t const* out)
+{
+    aliccp::OutputBuffers buffers;
+    buffers.feat_field_id = out->feat_field_id;
+    buffers.feat_id = out->feat_id;
+    buffers.values = out->values;
+    buffers.y = out->y;
+    buffers.z = out->z;
+    buffers.lens = out->lens;
+    buffers.id_dtype = static_cast<aliccp::DType>(out->id_dtype);
+    buffers.label_dtype = static_cast<aliccp::DType>(out->label_dtype);
+    buffers.value_dtype = static_cast<aliccp::DType>(out->value_dtype);
+    buffers.width = out->width;
+    for (int32_t c = 0; c < out->num_crosses; ++c) {
+        buffers.cross_fields.emplace_back(out->cross_fields[2 * c], out->cross_fields[2 * c + 1]);
+        buffers.crosses.push_back(out->crosses[c]);
+    }
+    buffers.cross_width = out->cross_width;
+    buffers.cross_buckets = out->cross_buckets;
+    return buffers;
+}
+
+extern "C" {
+
+aliccp_reader_t*
+aliccp_reader_open(const char* examples_db,
+                   const char* comm_feats_db,
+                   const char* vocab,
+                   int num_threads,
+                   char** errptr)
+{
+    return aliccp_reader_open_profile(examples_db, comm_feats_db, vocab, num_threads, "default", "", 1024, 0, errptr);
+}
+
+aliccp_reader_t*
+aliccp_reader_open_profile(const char* examples_db,
+                           const char* comm_feats_db,
+                           const char* vocab,
+                           int num_threads,
+                           const char* db_profile,
+                           const char* db_options_file,
+                           int64_t block_cache_mb,
+                           int direct_reads,
+                           char** errptr)
+{
+    aliccp::DbProfile profile;
+    if (save_error(errptr, aliccp::parse_db_profile(db_profile, &profile.kind))) {
+        return nullptr;
+    }
+    profile.options_file = db_options_file;
+    profile.block_cache_mb = block_cache_mb;
+    profile.direct_reads = direct_reads != 0;
+
+    std::unique_ptr<aliccp::Reader> rep;
+    if (save_error(errptr, aliccp::Reader::open(examples_db, comm_feats_db, vocab, num_threads, profile, &rep))) {
+        return nullptr;
+    }
+
+    auto reader = new aliccp_reader_t;
+    reader->rep = std::move(rep);
+    return reader;
+}
+
+aliccp_reader_t*
+aliccp_reader_open_snapshot(const char* snapshot,
+                            const char* vocab,
+                            int num_threads,
+                            int populate,
+                            int hugepages,
+                            char** errptr)
+{
+    std::unique_ptr<aliccp::Reader> rep;
+    auto status = aliccp::Reader::open_snapshot(snapshot, vocab, num_threads, populate != 0, hugepages != 0, &rep);
+    if (save_error(errptr, status)) {
+        return nullptr;
+    }
+
+    auto reader = new aliccp_reader_t;
+    reader->rep = std::move(rep);
+    return reader;
+}
+
+void
+aliccp_reader_close(aliccp_reader_t* reader)
+{
+    delete reader;
+}
+
+int
+aliccp_fill_batch(aliccp_reader_t* reader,
+                  const uint32_t* example_ids,
+                  size_t n,
+                  const aliccp_output_t* out,
+                  char** errptr)
+{
+    return save_error(errptr, reader->rep->fill_batch(example_ids, n, to_output_buffers(out))) ? -1 : 0;
+}
+
+aliccp_batch_t*
+aliccp_batch_create(void)
+{
+    return new aliccp_batch_t;
+}
+
+void
+aliccp_batch_destroy(aliccp_batch_t* batch)
+{
+    delete batch;
+}
+
+int
+aliccp_read(aliccp_reader_t* reader, const uint32_t* example_ids, size_t n, aliccp_batch_t* batch, char** errptr)
+{
+    return save_error(errptr, reader->rep->read(example_ids, n, batch->rep)) ? -1 : 0;
+}
+
+int32_t
+aliccp_pad_width(const aliccp_batch_t* batch, int32_t max_feats, const int32_t* boundaries, size_t nboundaries)
+{
+    std::vector<int32_t> sorted(boundaries, boundaries + nboundaries);
+    std::sort(sorted.begin(), sorted.end());
+    return aliccp::Reader::pad_width(batch->rep, max_feats, sorted);
+}
+
+int
+aliccp_fill(aliccp_reader_t* reader, const aliccp_batch_t* batch, const aliccp_output_t* out, char** errptr)
+{
+    return save_error(errptr, reader->rep->fill(batch->rep, to_output_buffers(out))) ? -1 : 0;
+}
+
+int
+aliccp_shard_ids(const char* examples_db,
+                 int num_workers,
+                 int worker_index,
+                 int ranges_per_worker,
+                 uint64_t seed,
+                 int64_t epoch,
+                 uint32_t** ids,
+                 size_t* n,
+                 char** errptr)
+{
+    std::vector<uint32_t> result;
+    auto status = aliccp::shard_ids(examples_db, num_workers, worker_index, ranges_per_worker, seed, epoch, &result);
+    if (save_error(errptr, status)) {
+        return -1;
+    }
+
+    *n = result.size();
+    *ids = static_cast<uint32_t*>(malloc(std::max<size_t>(1, result.size()) * sizeof(uint32_t)));
+    if (!*ids) {
+        save_error(errptr, rocksdb::Status::IOError("aliccp_shard_ids", "out of memory"));
+        return -1;
+    }
+    std::copy(result.cbegin(), result.cend(), *ids);
+    return 0;
+}
+
+void
+aliccp_free(void* p)
+{
+    free(p);
+}
+}
@@ -0,0 +1,124 @@
+#ifndef __ALICCP_C_H__
+#define __ALICCP_C_H__
+
+/* C api of libaliccp, for loaders that can't link C++ (ctypes, cffi, other runtimes).
+ * Functions that can fail take a char** errptr; on failure it is set to a malloc'ed
+ * message the caller releases with aliccp_free. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct aliccp_reader_t aliccp_reader_t;
+typedef struct aliccp_batch_t aliccp_batch_t;
+
+/* same values as aliccp::DType */
+enum
+{
+    ALICCP_INT32 = 0,
+    ALICCP_INT64 = 1,
+    ALICCP_UINT8 = 2,
+    ALICCP_FLOAT16 = 3,
+    ALICCP_BFLOAT16 = 4,
+    ALICCP_FLOAT32 = 5,
+};
+
+/* caller-owned row-major buffers, feat_field_id, feat_id and values are [n, width],
+ * y, z and lens are [n]. feat_field_id, feat_id and lens use id_dtype.
+ * crosses[c] is [n, cross_width] of id_dtype for the field pair cross_fields[2c], cross_fields[2c+1],
+ * leave num_crosses 0 for none. */
+typedef struct
+{
+    void* feat_field_id;
+    void* feat_id;
+    void* values;
+    void* y;
+    void* z;
+    void* lens;
+    int32_t id_dtype;
+    int32_t label_dtype;
+    int32_t value_dtype;
+    int32_t width;
+    const uint32_t* cross_fields;
+    void** crosses;
+    int32_t num_crosses;
+    int32_t cross_width;
+    uint64_t cross_buckets;
+} aliccp_output_t;
+
+/* num_threads <= 0 uses one thread per core, comm_feats_db may be empty for examples written
+ * with write_to_db -prejoin */
+aliccp_reader_t*
+aliccp_reader_open(const char* examples_db,
+                   const char* comm_feats_db,
+                   const char* vocab,
+                   int num_threads,
+                   char** errptr);
+/* db_profile is "default" or "point_lookup", a non-empty db_options_file is a rocksdb OPTIONS
+ * file used instead of the profile */
+aliccp_reader_t*
+aliccp_reader_open_profile(const char* examples_db,
+                           const char* comm_feats_db,
+                           const char* vocab,
+                           int num_threads,
+                           const char* db_profile,
+                           const char* db_options_file,
+                           int64_t block_cache_mb,
+                           int direct_reads,
+                           char** errptr);
+/* reads from a file written by export_snapshot instead of the dbs, populate and hugepages are
+ * mmap hints */
+aliccp_reader_t*
+aliccp_reader_open_snapshot(const char* snapshot,
+                            const char* vocab,
+                            int num_threads,
+                            int populate,
+                            int hugepages,
+                            char** errptr);
+void
+aliccp_reader_close(aliccp_reader_t* reader);
+
+/* read + fill n examples into out->width columns in one call */
+int
+aliccp_fill_batch(aliccp_reader_t* reader,
+                  const uint32_t* example_ids,
+                  size_t n,
+                  const aliccp_output_t* out,
+                  char** errptr);
+
+/* two step form for callers that size their buffers by the batch, e.g. length buckets */
+aliccp_batch_t*
+aliccp_batch_create(void);
+void
+aliccp_batch_destroy(aliccp_batch_t* batch);
+int
+aliccp_read(aliccp_reader_t* reader, const uint32_t* example_ids, size_t n, aliccp_batch_t* batch, char** errptr);
+int32_t
+aliccp_pad_width(const aliccp_batch_t* batch, int32_t max_feats, const int32_t* boundaries, size_t nboundaries);
+int
+aliccp_fill(aliccp_reader_t* reader, const aliccp_batch_t* batch, const aliccp_output_t* out, char** errptr);
+
+/* example ids of worker_index in an epoch, see aliccp_shard.h. *ids is malloc'ed, release it
+ * with aliccp_free */
+int
+aliccp_shard_ids(const char* examples_db,
+                 int num_workers,
+                 int worker_index,
+                 int ranges_per_worker,
+                 uint64_t seed,
+                 int64_t epoch,
+                 uint32_t** ids,
+                 size_t* n,
+                 char** errptr);
+
+void
+aliccp_free(void* p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,160 @@
+"""ctypes binding of libaliccp.so, fills numpy arrays without tensorflow.
+
+    reader = Reader('../examples.db', '../common_feats.db', './field_feat_vocab.bin')
+    out = reader.fill_batch(np.array([1, 2, 3], dtype=np.uint32), max_feats=1000)
+"""
+
+import ctypes
+import os
+
+import numpy as np
+
+_DTYPES = {
+    np.dtype(np.int32): 0,
+    np.dtype(np.int64): 1,
+    np.dtype(np.uint8): 2,
+    np.dtype(np.float16): 3,
+    np.dtype(np.float32): 5,
+}
+
+
+class _Output(ctypes.Structure):
+    _fields_ = [
+        ('feat_field_id', ctypes.c_void_p),
+        ('feat_id', ctypes.c_void_p),
+        ('values', ctypes.c_void_p),
+        ('y', ctypes.c_void_p),
+        ('z', ctypes.c_void_p),
+        ('lens', ctypes.c_void_p),
+        ('id_dtype', ctypes.c_int32),
+        ('label_dtype', ctypes.c_int32),
+        ('value_dtype', ctypes.c_int32),
+        ('width', ctypes.c_int32),
+        ('cross_fields', ctypes.POINTER(ctypes.c_uint32)),
+        ('crosses', ctypes.POINTER(ctypes.c_void_p)),
+        ('num_crosses', ctypes.c_int32),
+        ('cross_width', ctypes.c_int32),
+        ('cross_buckets', ctypes.c_uint64),
+    ]
+
+
+def _load(path):
+    lib = ctypes.CDLL(path)
+    errptr = ctypes.POINTER(ctypes.c_char_p)
+    u32p = ctypes.POINTER(ctypes.c_uint32)
+
+    lib.aliccp_reader_open.restype = ctypes.c_void_p
+    lib.aliccp_reader_open.argtypes = [ctypes.c_char_p, ctypes.c_char_p, ctypes.c_char_p, ctypes.c_int, errptr]
+    lib.aliccp_reader_open_profile.restype = ctypes.c_void_p
+    lib.aliccp_reader_open_profile.argtypes = [ctypes.c_char_p, ctypes.c_char_p, ctypes.c_char_p, ctypes.c_int,
+                                               ctypes.c_char_p, ctypes.c_char_p, ctypes.c_int64, ctypes.c_int, errptr]
+    lib.aliccp_reader_open_snapshot.restype = ctypes.c_void_p
+    lib.aliccp_reader_open_snapshot.argtypes = [ctypes.c_char_p, ctypes.c_char_p, ctypes.c_int, ctypes.c_int,
+                                                ctypes.c_int, errptr]
+    lib.aliccp_reader_close.argtypes = [ctypes.c_void_p]
+    lib.aliccp_fill_batch.argtypes = [ctypes.c_void_p, u32p, ctypes.c_size_t, ctypes.POINTER(_Output), errptr]
+    lib.aliccp_batch_create.restype = ctypes.c_void_p
+    lib.aliccp_batch_destroy.argtypes = [ctypes.c_void_p]
+    lib.aliccp_read.argtypes = [ctypes.c_void_p, u32p, ctypes.c_size_t, ctypes.c_void_p, errptr]
+    lib.aliccp_pad_width.restype = ctypes.c_int32
+    lib.aliccp_pad_width.argtypes = [ctypes.c_void_p, ctypes.c_int32, ctypes.POINTER(ctypes.c_int32), ctypes.c_size_t]
+    lib.aliccp_fill.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.POINTER(_Output), errptr]
+    lib.aliccp_shard_ids.argtypes = [ctypes.c_char_p, ctypes.c_int, ctypes.c_int, ctypes.c_int, ctypes.c_uint64,
+                                     ctypes.c_int64, ctypes.POINTER(u32p), ctypes.POINTER(ctypes.c_size_t), errptr]
+    lib.aliccp_free.argtypes = [ctypes.c_void_p]
+    return lib
+
+
+def _check(lib, rc, err):
+    if rc == 0:
+        return
+    # c_char_p copies the message, free through the raw pointer
+    msg = err.value.decode()
+    lib.aliccp_free(ctypes.cast(err, ctypes.c_void_p))
+    raise RuntimeError(msg)
+
+
+class Reader(object):
+    """snapshot replaces examples_db and comm_feats_db with a file written by export_snapshot. comm_feats_db may be
+    empty for examples written with write_to_db -prejoin. db_profile is 'default' or 'point_lookup',
+    db_options_file is a rocksdb OPTIONS file used instead of it"""
+
+    def __init__(self, examples_db, comm_feats_db, vocab, num_threads=0, snapshot=None, populate=False,
+                 hugepages=False, db_profile='default', db_options_file='', block_cache_mb=1024, direct_reads=False,
+                 lib_path=os.path.join(os.path.dirname(os.path.abspath(__file__)), 'libaliccp.so')):
+        self._lib = _load(lib_path)
+        err = ctypes.c_char_p()
+        if snapshot:
+            self._reader = self._lib.aliccp_reader_open_snapshot(snapshot.encode(), vocab.encode(), num_threads,
+                                                                 int(populate), int(hugepages), ctypes.byref(err))
+        else:
+            self._reader = self._lib.aliccp_reader_open_profile(examples_db.encode(), comm_feats_db.encode(),
+                                                                vocab.encode(), num_threads, db_profile.encode(),
+                                                                db_options_file.encode(), block_cache_mb,
+                                                                int(direct_reads), ctypes.byref(err))
+        if not self._reader:
+            _check(self._lib, -1, err)
+
+    def close(self):
+        if self._reader:
+            self._lib.aliccp_reader_close(self._reader)
+            self._reader = None
+
+    def __del__(self):
+        self.close()
+
+    def fill_batch(self, example_ids, max_feats, bucket_boundaries=(),
+                   id_dtype=np.int64, label_dtype=np.int64, value_dtype=np.float32,
+                   cross_fields=(), cross_buckets=1000000, max_cross_feats=16):
+        """returns dict of feat_field_id, feat_id, features, y, z, lens and a list of crosses, same layout
+        as the tensorflow op. cross_fields is a sequence of (field_a, field_b) pairs"""
+        ids = np.ascontiguousarray(example_ids, dtype=np.uint32)
+        u32p = ctypes.POINTER(ctypes.c_uint32)
+        err = ctypes.c_char_p()
+
+        batch = self._lib.aliccp_batch_create()
+        try:
+            _check(self._lib, self._lib.aliccp_read(self._reader, ids.ctypes.data_as(u32p), len(ids), batch,
+                                                    ctypes.byref(err)), err)
+            boundaries = np.ascontiguousarray(bucket_boundaries, dtype=np.int32)
+            width = self._lib.aliccp_pad_width(batch, max_feats,
+                                               boundaries.ctypes.data_as(ctypes.POINTER(ctypes.c_int32)),
+                                               len(boundaries))
+
+            n = len(ids)
+            res = {
+                'feat_field_id': np.empty((n, width), dtype=id_dtype),
+                'feat_id': np.empty((n, width), dtype=id_dtype),
+                'features': np.empty((n, width), dtype=value_dtype),
+                'y': np.empty((n, ), dtype=label_dtype),
+                'z': np.empty((n, ), dtype=label_dtype),
+                'lens': np.empty((n, ), dtype=id_dtype),
+            }
+            res['crosses'] = [np.empty((n, max_cross_feats), dtype=id_dtype) for _ in cross_fields]
+            fields = np.ascontiguousarray(np.array(cross_fields, dtype=np.uint32).reshape(-1))
+            crosses = (ctypes.c_void_p * max(1, len(cross_fields)))(*[c.ctypes.data for c in res['crosses']])
+            out = _Output(res['feat_field_id'].ctypes.data, res['feat_id'].ctypes.data, res['features'].ctypes.data,
+                          res['y'].ctypes.data, res['z'].ctypes.data, res['lens'].ctypes.data,
+                          _DTYPES[np.dtype(id_dtype)], _DTYPES[np.dtype(label_dtype)],
+                          _DTYPES[np.dtype(value_dtype)], width,
+                          fields.ctypes.data_as(ctypes.POINTER(ctypes.c_uint32)), crosses, len(cross_fields),
+                          max_cross_feats, cross_buckets)
+            _check(self._lib, self._lib.aliccp_fill(self._reader, batch, ctypes.byref(out), ctypes.byref(err)), err)
+            return res
+        finally:
+            self._lib.aliccp_batch_destroy(batch)
+
+
+def shard_ids(examples_db, num_workers, worker_index, epoch, ranges_per_worker=8, seed=0,
+              lib_path=os.path.join(os.path.dirname(os.path.abspath(__file__)), 'libaliccp.so')):
+    """example ids of worker_index in an epoch, same split as AliCCPShardedIds"""
+    lib = _load(lib_path)
+    ids = ctypes.POINTER(ctypes.c_uint32)()
+    n = ctypes.c_size_t()
+    err = ctypes.c_char_p()
+    _check(lib, lib.aliccp_shard_ids(examples_db.encode(), num_workers, worker_index, ranges_per_worker, seed, epoch,
+                                     ctypes.byref(ids), ctypes.byref(n), ctypes.byref(err)), err)
+    try:
+        return np.ctypeslib.as_array(ids, shape=(n.value, )).copy() if n.value else np.empty((0, ), dtype=np.uint32)
+    finally:
+        lib.aliccp_free(ids)
@@ -0,0 +1,78 @@
+#ifndef __ALICCP_KEY_H__
+#define __ALICCP_KEY_H__
+
+#include <rocksdb/db.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+namespace aliccp {
+
+// key formats of the examples db. legacy keys are the native (little endian) bytes of example_id,
+// which the bytewise comparator sorts apart from the numeric order. big endian keys sort like the
+// ids, so a numeric id range is one key range and consecutive ids share sst blocks.
+uint32_t const kKeyFormatLegacy = 1;
+uint32_t const kKeyFormatBigEndian = 2;
+size_t const kExampleKeySize = sizeof(uint32_t);
+
+// examples db entry holding the key format, a db without it is legacy. it is longer than an
+// example key, scans over example keys skip it.
+char const kKeyFormatKey[] = "\xff"
+                             "aliccp.key_format";
+
+inline void
+encode_example_key(uint32_t const example_id, uint32_t const key_format, char* key)
+{
+    if (key_format == kKeyFormatBigEndian) {
+        key[0] = static_cast<char>(example_id >> 24);
+        key[1] = static_cast<char>(example_id >> 16);
+        key[2] = static_cast<char>(example_id >> 8);
+        key[3] = static_cast<char>(example_id);
+    } else {
+        memcpy(key, &example_id, kExampleKeySize);
+    }
+}
+
+inline uint32_t
+decode_example_key(const char* key, uint32_t const key_format)
+{
+    uint32_t example_id;
+    if (key_format == kKeyFormatBigEndian) {
+        auto const p = reinterpret_cast<const uint8_t*>(key);
+        example_id = (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+    } else {
+        memcpy(&example_id, key, kExampleKeySize);
+    }
+    return example_id;
+}
+
+inline rocksdb::Status
+read_key_format(rocksdb::DB* db, uint32_t* key_format)
+{
+    std::string value;
+    auto status = db->Get(rocksdb::ReadOptions(), kKeyFormatKey, &value);
+    if (status.IsNotFound()) {
+        *key_format = kKeyFormatLegacy;
+        return rocksdb::Status::OK();
+    }
+    if (!status.ok()) {
+        return status;
+    }
+
+    auto const format = strtoul(value.c_str(), nullptr, 10);
+    if (format != kKeyFormatLegacy && format != kKeyFormatBigEndian) {
+        return rocksdb::Status::NotSupported("unknown example key format", value);
+    }
+    *key_format = static_cast<uint32_t>(format);
+    return rocksdb::Status::OK();
+}
+
+inline rocksdb::Status
+write_key_format(rocksdb::DB* db, uint32_t const key_format)
+{
+    return db->Put(rocksdb::WriteOptions(), kKeyFormatKey, std::to_string(key_format));
+}
+}
+
+#endif
@@ -0,0 +1,101 @@
+#include "aliccp_options.h"
+#include <rocksdb/cache.h>
+#include <rocksdb/filter_policy.h>
+#include <rocksdb/statistics.h>
+#include <rocksdb/utilities/options_util.h>
+#include <vector>
+
+namespace aliccp {
+
+rocksdb::Status
+parse_db_profile(std::string const& name, DbProfile::Kind* kind)
+{
+    if (name == "default") {
+        *kind = DbProfile::kDefault;
+    } else if (name == "point_lookup") {
+        *kind = DbProfile::kPointLookup;
+    } else {
+        return rocksdb::Status::InvalidArgument("unknown db profile", name);
+    }
+    return rocksdb::Status::OK();
+}
+
+void
+set_table_layout(DbProfile::Kind const kind, rocksdb::BlockBasedTableOptions* table_opt)
+{
+    table_opt->block_size = 4 * 1024;
+    table_opt->filter_policy.reset(rocksdb::NewBloomFilterPolicy(10, false));
+    table_opt->whole_key_filtering = true;
+
+    if (kind == DbProfile::kDefault) {
+        // kHashSearch needs a prefix_extractor, the dbs have none and rocksdb binary searches anyway
+        table_opt->index_type = rocksdb::BlockBasedTableOptions::kBinarySearch;
+        return;
+    }
+
+    // every lookup is a whole key, a hash index inside the data block replaces its binary search
+    table_opt->data_block_index_type = rocksdb::BlockBasedTableOptions::kDataBlockBinaryAndHash;
+    table_opt->data_block_hash_table_util_ratio = 0.75;
+    // partitions of the index and filters are cached like data blocks, only their top level has
+    // to stay in memory
+    table_opt->index_type = rocksdb::BlockBasedTableOptions::kTwoLevelIndexSearch;
+    table_opt->partition_filters = true;
+    table_opt->metadata_block_size = 4 * 1024;
+}
+
+rocksdb::Status
+read_db_options(DbProfile const& profile, rocksdb::Options* opt)
+{
+    if (!profile.options_file.empty()) {
+        rocksdb::DBOptions db_opt;
+        std::vector<rocksdb::ColumnFamilyDescriptor> cf_descs;
+        auto status = rocksdb::LoadOptionsFromFile(profile.options_file, rocksdb::Env::Default(), &db_opt, &cf_descs);
+        if (!status.ok()) {
+            return status;
+        }
+        if (cf_descs.empty()) {
+            return rocksdb::Status::InvalidArgument(profile.options_file, "no column family options");
+        }
+
+        *opt = rocksdb::Options(db_opt, cf_descs[0].options);
+        opt->create_if_missing = false;
+        opt->use_direct_reads = opt->use_direct_reads || profile.direct_reads;
+        return rocksdb::Status::OK();
+    }
+
+    if (profile.block_cache_mb <= 0) {
+        return rocksdb::Status::InvalidArgument("block_cache_mb must be positive");
+    }
+
+    *opt = rocksdb::Options();
+    opt->create_if_missing = false;
+    opt->max_open_files = -1;
+    opt->max_write_buffer_number = 3;
+    opt->target_file_size_base = 67108864;
+    opt->compression = rocksdb::kZlibCompression;
+    opt->use_direct_reads = profile.direct_reads;
+
+    rocksdb::BlockBasedTableOptions table_opt;
+    set_table_layout(profile.kind, &table_opt);
+    table_opt.block_cache = rocksdb::NewLRUCache(static_cast<size_t>(profile.block_cache_mb) * 1024 * 1024);
+    table_opt.cache_index_and_filter_blocks = true;
+
+    if (profile.kind == DbProfile::kDefault) {
+        opt->new_table_reader_for_compaction_inputs = true;
+        opt->statistics = rocksdb::CreateDBStatistics();
+        opt->stats_dump_period_sec = 10;
+        table_opt.block_cache_compressed = rocksdb::NewLRUCache(500 * (1024 * 1024));
+    } else {
+        // statistics are counted on every lookup and the dump only goes to the LOG
+        opt->stats_dump_period_sec = 0;
+        // index and filter blocks of L0 and the top level of partitioned ones never leave the
+        // cache, the rest competes with data blocks but is evicted last
+        table_opt.cache_index_and_filter_blocks_with_high_priority = true;
+        table_opt.pin_l0_filter_and_index_blocks_in_cache = true;
+        table_opt.pin_top_level_index_and_filter = true;
+    }
+
+    opt->table_factory.reset(rocksdb::NewBlockBasedTableFactory(table_opt));
+    return rocksdb::Status::OK();
+}
+}
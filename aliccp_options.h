@@ -0,0 +1,46 @@
+#ifndef __ALICCP_OPTIONS_H__
+#define __ALICCP_OPTIONS_H__
+
+#include <rocksdb/options.h>
+#include <rocksdb/status.h>
+#include <rocksdb/table.h>
+#include <stdint.h>
+#include <string>
+
+namespace aliccp {
+
+// rocksdb options of the examples and comm feats dbs
+struct DbProfile
+{
+    enum Kind
+    {
+        // the options the dbs have always been written and read with
+        kDefault = 0,
+        // for batched MultiGet: data blocks with a hash index, a partitioned index and partitioned
+        // whole key bloom filters, L0 and top level index and filter blocks pinned in the cache
+        kPointLookup = 1,
+    };
+
+    Kind kind = kDefault;
+    // an OPTIONS file written by rocksdb replaces the profile when reading, only direct_reads
+    // still applies
+    std::string options_file;
+    int64_t block_cache_mb = 1024;
+    bool direct_reads = false;
+};
+
+// "default" or "point_lookup"
+rocksdb::Status
+parse_db_profile(std::string const& name, DbProfile::Kind* kind);
+
+// layout of the sst files. it is fixed when a file is written, so write_to_db has to write with
+// the profile the dbs are read with to get its index and filters.
+void
+set_table_layout(DbProfile::Kind const kind, rocksdb::BlockBasedTableOptions* table_opt);
+
+// options to open a db for reading
+rocksdb::Status
+read_db_options(DbProfile const& profile, rocksdb::Options* opt);
+}
+
+#endif
@@ -0,0 +1,631 @@
+#include "aliccp_reader.h"
+#include "vocab_generated.h"
+#include <algorithm>
+#include <errno.h>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <rocksdb/options.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace aliccp {
+
+namespace {
+// row costs of fill, in approximate cpu cycles like the cost_per_unit of ParallelFor
+uint64_t const kLookupCost = 100;
+uint64_t const kMinShardCost = 100000;
+uint64_t const kMaxShards = 256;
+
+// 16 bit float storage, converted with round to nearest even
+struct Float16
+{
+    explicit Float16(float const f)
+    {
+        uint32_t x;
+        memcpy(&x, &f, sizeof(x));
+        uint32_t const sign = (x >> 16) & 0x8000;
+        uint32_t const abs = x & 0x7fffffff;
+
+        if (abs >= 0x7f800000) {
+            bits = static_cast<uint16_t>(sign | 0x7c00 | (abs > 0x7f800000 ? 0x200 : 0));
+        } else if (abs >= 0x477ff000) {
+            // rounds above 65504
+            bits = static_cast<uint16_t>(sign | 0x7c00);
+        } else if (abs < 0x33000000) {
+            bits = static_cast<uint16_t>(sign);
+        } else if (abs < 0x38800000) {
+            // subnormal half
+            uint32_t const shift = 126 - (abs >> 23);
+            uint32_t const m = (abs & 0x7fffff) | 0x800000;
+            uint32_t h = m >> shift;
+            uint32_t const rem = m & ((1u << shift) - 1);
+            uint32_t const halfway = 1u << (shift - 1);
+            if (rem > halfway || (rem == halfway && (h & 1))) {
+                ++h;
+            }
+            bits = static_cast<uint16_t>(sign | h);
+        } else {
+            uint32_t h = (abs - 0x38000000) >> 13;
+            uint32_t const rem = abs & 0x1fff;
+            if (rem > 0x1000 || (rem == 0x1000 && (h & 1))) {
+                ++h;
+            }
+            bits = static_cast<uint16_t>(sign | h);
+        }
+    }
+
+    uint16_t bits;
+};
+
+struct BFloat16
+{
+    explicit BFloat16(float const f)
+    {
+        uint32_t x;
+        memcpy(&x, &f, sizeof(x));
+        if ((x & 0x7fffffff) > 0x7f800000) {
+            bits = static_cast<uint16_t>((x >> 16) | 0x40);
+        } else {
+            x += 0x7fff + ((x >> 16) & 1);
+            bits = static_cast<uint16_t>(x >> 16);
+        }
+    }
+
+    uint16_t bits;
+};
+
+// splitmix64 finalizer
+uint64_t
+mix(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// (feat_field_id, feat_id) of the features of an example that take part in a cross
+using FieldFeats = std::vector<std::pair<uint32_t, uint32_t>>;
+
+void
+collect_cross_feats(flatbuffers::Vector<flatbuffers::Offset<Feature>> const* feats,
+                    std::vector<uint32_t> const& fields,
+                    FieldFeats& out)
+{
+    for (auto const feat : *feats) {
+        if (std::binary_search(fields.cbegin(), fields.cend(), feat->feat_field_id())) {
+            out.emplace_back(feat->feat_field_id(), feat->feat_id());
+        }
+    }
+}
+
+// raw feat ids are hashed, so features missing from the vocab still cross
+template<typename IdT>
+void
+fill_cross(FieldFeats const& feats,
+           std::pair<uint32_t, uint32_t> const& fields,
+           uint64_t const buckets,
+           IdT* row,
+           int64_t const width)
+{
+    int64_t k = 0;
+    for (auto a = feats.cbegin(); a != feats.cend() && k < width; ++a) {
+        if (a->first != fields.first) {
+            continue;
+        }
+
+        auto const left = mix((static_cast<uint64_t>(a->first) << 32) | a->second);
+        for (auto b = feats.cbegin(); b != feats.cend() && k < width; ++b) {
+            if (b->first == fields.second) {
+                auto const right = (static_cast<uint64_t>(b->first) << 32) | b->second;
+                row[k++] = static_cast<IdT>(mix(left ^ right) % buckets + 1);
+            }
+        }
+    }
+
+    for (; k < width; ++k) {
+        row[k] = 0;
+    }
+}
+
+template<typename T>
+T
+cast_value(float const value)
+{
+    return static_cast<T>(value);
+}
+
+template<>
+Float16
+cast_value<Float16>(float const value)
+{
+    return Float16(value);
+}
+
+template<>
+BFloat16
+cast_value<BFloat16>(float const value)
+{
+    return BFloat16(value);
+}
+}
+
+int32_t
+bucket_width(std::vector<int32_t> const& boundaries, int32_t const len, int32_t const max_feats)
+{
+    auto it = std::lower_bound(boundaries.cbegin(), boundaries.cend(), len);
+    if (it == boundaries.cend()) {
+        return max_feats;
+    }
+
+    return std::min(*it, max_feats);
+}
+
+rocksdb::Status
+Reader::open(std::string const& examples_db,
+             std::string const& comm_feats_db,
+             std::string const& vocab,
+             int const num_threads,
+             DbProfile const& profile,
+             std::unique_ptr<Reader>* reader)
+{
+    std::unique_ptr<Reader> r(new Reader());
+    r->pool_.reset(new ThreadPool(num_threads));
+
+    auto status = r->read_vocab(vocab);
+    if (!status.ok()) {
+        return status;
+    }
+
+    status = open_readonly_db(examples_db, profile, &r->example_db_);
+    if (!status.ok()) {
+        return rocksdb::Status::InvalidArgument(examples_db, status.ToString());
+    }
+
+    status = read_key_format(r->example_db_.get(), &r->key_format_);
+    if (!status.ok()) {
+        return rocksdb::Status::InvalidArgument(examples_db, status.ToString());
+    }
+
+    // an examples db written with -prejoin needs no comm feats db
+    if (!comm_feats_db.empty()) {
+        status = open_readonly_db(comm_feats_db, profile, &r->comm_feats_db_);
+        if (!status.ok()) {
+            return rocksdb::Status::InvalidArgument(comm_feats_db, status.ToString());
+        }
+    }
+
+    *reader = std::move(r);
+    return rocksdb::Status::OK();
+}
+
+rocksdb::Status
+Reader::open_snapshot(std::string const& snapshot,
+                      std::string const& vocab,
+                      int const num_threads,
+                      bool const populate,
+                      bool const hugepages,
+                      std::unique_ptr<Reader>* reader)
+{
+    std::unique_ptr<Reader> r(new Reader());
+    r->pool_.reset(new ThreadPool(num_threads));
+
+    auto status = r->read_vocab(vocab);
+    if (!status.ok()) {
+        return status;
+    }
+
+    status = Snapshot::open(snapshot, populate, hugepages, &r->snapshot_);
+    if (!status.ok()) {
+        return rocksdb::Status::InvalidArgument(snapshot, status.ToString());
+    }
+
+    *reader = std::move(r);
+    return rocksdb::Status::OK();
+}
+
+rocksdb::Status
+Reader::read(uint32_t const* example_ids, size_t const n, Batch& batch) const
+{
+    if (snapshot_) {
+        return read_snapshot(example_ids, n, batch);
+    }
+
+    auto& key_bytes = batch.key_bytes;
+    key_bytes.resize(n * kExampleKeySize);
+    for (size_t i = 0; i < n; ++i) {
+        encode_example_key(example_ids[i], key_format_, &key_bytes[i * kExampleKeySize]);
+    }
+
+    // sorted_input wants the keys in the bytewise order of the db comparator, for big endian
+    // keys that is the order of the ids
+    auto& order = batch.order;
+    order.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+        order[i] = static_cast<uint32_t>(i);
+    }
+    std::sort(order.begin(), order.end(), [&key_bytes](uint32_t const a, uint32_t const b) {
+        return memcmp(&key_bytes[a * kExampleKeySize], &key_bytes[b * kExampleKeySize], kExampleKeySize) < 0;
+    });
+
+    auto& keys = batch.keys;
+    keys.clear();
+    for (auto const i : order) {
+        keys.emplace_back(&key_bytes[i * kExampleKeySize], kExampleKeySize);
+    }
+
+    auto status = read_db(example_db_, keys, batch.example_values, batch.statuses);
+    if (!status.ok()) {
+        return status;
+    }
+
+    batch.examples.resize(n);
+    for (size_t j = 0; j < n; ++j) {
+        batch.examples[order[j]] = GetExample(batch.example_values[j].data());
+    }
+
+    // comm feat ids point into the pinned examples, sorting them deduplicates them as well.
+    // joined examples carry their comm feats and skip the second lookup.
+    auto const less = [](rocksdb::Slice const& a, rocksdb::Slice const& b) { return a.compare(b) < 0; };
+    keys.clear();
+    for (auto const example : batch.examples) {
+        if (example->joined()) {
+            continue;
+        }
+        auto id = example->comm_feat_id();
+        keys.emplace_back(id->c_str(), id->Length());
+    }
+
+    batch.comm_feats.assign(n, nullptr);
+    if (keys.empty()) {
+        batch.comm_feat_values.release();
+        return rocksdb::Status::OK();
+    }
+    if (!comm_feats_db_) {
+        return rocksdb::Status::InvalidArgument("examples are not prejoined and no comm_feats_db is given");
+    }
+
+    std::sort(keys.begin(), keys.end(), less);
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+    status = read_db(comm_feats_db_, keys, batch.comm_feat_values, batch.statuses);
+    if (!status.ok()) {
+        return status;
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        if (batch.examples[i]->joined()) {
+            continue;
+        }
+        auto id = batch.examples[i]->comm_feat_id();
+        rocksdb::Slice const key(id->c_str(), id->Length());
+        auto it = std::lower_bound(keys.cbegin(), keys.cend(), key, less);
+        batch.comm_feats[i] = it != keys.cend() && *it == key
+                                  ? GetCommFeature(batch.comm_feat_values[it - keys.cbegin()].data())
+                                  : nullptr;
+    }
+
+    return rocksdb::Status::OK();
+}
+
+rocksdb::Status
+Reader::read_snapshot(uint32_t const* example_ids, size_t const n, Batch& batch) const
+{
+    batch.release();
+    batch.examples.resize(n);
+    batch.comm_feats.resize(n);
+
+    for (size_t i = 0; i < n; ++i) {
+        batch.examples[i] = snapshot_->example(example_ids[i]);
+        if (!batch.examples[i]) {
+            return rocksdb::Status::Corruption("NotFound in snapshot: example_id = " + std::to_string(example_ids[i]));
+        }
+        batch.comm_feats[i] = snapshot_->comm_feat(example_ids[i]);
+        if (!batch.comm_feats[i] && !batch.examples[i]->joined()) {
+            return rocksdb::Status::Corruption("comm feat NotFound in snapshot: example_id = " +
+                                               std::to_string(example_ids[i]));
+        }
+    }
+
+    return rocksdb::Status::OK();
+}
+
+template<typename IdT, typename LabelT, typename ValueT>
+void
+Reader::fill_rows(Batch const& batch, OutputBuffers const& out, ParallelFor const& parallel_for) const
+{
+    auto const width = static_cast<int64_t>(out.width);
+    auto const field_ids = static_cast<IdT*>(out.feat_field_id);
+    auto const feat_ids = static_cast<IdT*>(out.feat_id);
+    auto const values = static_cast<ValueT*>(out.values);
+    auto const y = static_cast<LabelT*>(out.y);
+    auto const z = static_cast<LabelT*>(out.z);
+    auto const lens = static_cast<IdT*>(out.lens);
+
+    auto const& examples = batch.examples;
+    auto const& comm_feats = batch.comm_feats;
+    auto const n = examples.size();
+
+    // lengths vary by orders of magnitude, so shards are cut on the prefix sum of the row costs
+    // rather than on example counts. a row costs a vocab lookup per copied feature and a store
+    // per column.
+    std::vector<uint64_t> prefix(n + 1, 0);
+    for (size_t i = 0; i < n; ++i) {
+        auto const copied = examples[i] ? std::min<int64_t>(feature_len(batch, i), width) : 0;
+        prefix[i + 1] = prefix[i] + kLookupCost * copied + width + out.cross_fields.size() * out.cross_width;
+    }
+
+    std::vector<uint32_t> cross_field_set;
+    for (auto const& fields : out.cross_fields) {
+        cross_field_set.push_back(fields.first);
+        cross_field_set.push_back(fields.second);
+    }
+    std::sort(cross_field_set.begin(), cross_field_set.end());
+    cross_field_set.erase(std::unique(cross_field_set.begin(), cross_field_set.end()), cross_field_set.end());
+    auto const cross_width = static_cast<int64_t>(out.cross_width);
+
+    auto const total = prefix[n];
+    auto const nshards = static_cast<size_t>(
+        std::max<uint64_t>(1, std::min<uint64_t>(total / kMinShardCost, std::min<uint64_t>(n, kMaxShards))));
+    std::vector<size_t> bounds(nshards + 1, n);
+    for (size_t s = 0; s < nshards; ++s) {
+        auto const target = static_cast<uint64_t>(static_cast<double>(total) * s / nshards);
+        bounds[s] = std::lower_bound(prefix.cbegin(), prefix.cend(), target) - prefix.cbegin();
+    }
+
+    auto parse_shards = [&](int64_t start, int64_t end) {
+        FieldFeats cross_feats;
+        for (auto i = static_cast<int64_t>(bounds[start]); i < static_cast<int64_t>(bounds[end]); ++i) {
+            auto const example = examples[i];
+            if (!example) {
+                continue;
+            }
+
+            y[i] = static_cast<LabelT>(example->y());
+            z[i] = static_cast<LabelT>(example->z());
+
+            auto const row = i * width;
+            auto feats = example->feats();
+
+            int64_t k = 0;
+            int64_t len = std::min((int64_t)feats->Length(), width);
+            for (; k < len; ++k) {
+                auto feat = feats->Get(k);
+                values[row + k] = cast_value<ValueT>(feat->value());
+                field_ids[row + k] = static_cast<IdT>(feat->feat_field_id());
+                feat_ids[row + k] = static_cast<IdT>(vocab_id(feat->feat_field_id(), feat->feat_id()));
+            }
+
+            if (comm_feats[i]) {
+                auto const comm_feat = comm_feats[i]->feats();
+                auto cap = std::min(width, (int64_t)(comm_feat->Length() + feats->Length()));
+                for (; k < cap; ++k) {
+                    auto feat = comm_feat->Get(k - len);
+                    values[row + k] = cast_value<ValueT>(feat->value());
+                    field_ids[row + k] = static_cast<IdT>(feat->feat_field_id());
+                    feat_ids[row + k] = static_cast<IdT>(vocab_id(feat->feat_field_id(), feat->feat_id()));
+                }
+            }
+
+            lens[i] = static_cast<IdT>(k);
+            for (; k < width; ++k) {
+                values[row + k] = cast_value<ValueT>(0.0f);
+                field_ids[row + k] = 0;
+                feat_ids[row + k] = 0;
+            }
+
+            if (out.cross_fields.empty()) {
+                continue;
+            }
+
+            // crosses see every feature of the example, not only the ones kept under width
+            cross_feats.clear();
+            collect_cross_feats(feats, cross_field_set, cross_feats);
+            if (comm_feats[i]) {
+                collect_cross_feats(comm_feats[i]->feats(), cross_field_set, cross_feats);
+            }
+            for (size_t c = 0; c < out.cross_fields.size(); ++c) {
+                fill_cross(cross_feats,
+                           out.cross_fields[c],
+                           out.cross_buckets,
+                           static_cast<IdT*>(out.crosses[c]) + i * cross_width,
+                           cross_width);
+            }
+        }
+    };
+
+    // shards are equally expensive, so any contiguous split of them by the pool is balanced
+    auto const cost_per_unit = static_cast<int64_t>(std::max<uint64_t>(1, total / nshards));
+    if (parallel_for) {
+        parallel_for(nshards, cost_per_unit, parse_shards);
+    } else {
+        pool_->parallel_for(nshards, cost_per_unit, parse_shards);
+    }
+}
+
+// every dtype combination gets its own fill loop, dtypes are dispatched once per batch
+template<typename IdT, typename LabelT>
+Reader::FillFn
+Reader::select_value_dtype(DType const value_dtype)
+{
+    switch (value_dtype) {
+        case DType::kFloat16:
+            return &Reader::fill_rows<IdT, LabelT, Float16>;
+        case DType::kBFloat16:
+            return &Reader::fill_rows<IdT, LabelT, BFloat16>;
+        case DType::kFloat32:
+            return &Reader::fill_rows<IdT, LabelT, float>;
+        default:
+            return nullptr;
+    }
+}
+
+template<typename IdT>
+Reader::FillFn
+Reader::select_label_dtype(DType const label_dtype, DType const value_dtype)
+{
+    switch (label_dtype) {
+        case DType::kUInt8:
+            return select_value_dtype<IdT, uint8_t>(value_dtype);
+        case DType::kInt32:
+            return select_value_dtype<IdT, int32_t>(value_dtype);
+        case DType::kInt64:
+            return select_value_dtype<IdT, int64_t>(value_dtype);
+        default:
+            return nullptr;
+    }
+}
+
+rocksdb::Status
+Reader::fill(Batch const& batch, OutputBuffers const& out, ParallelFor const& parallel_for) const
+{
+    if (!out.feat_field_id || !out.feat_id || !out.values || !out.y || !out.z || !out.lens || out.width < 0) {
+        return rocksdb::Status::InvalidArgument("output buffers are incomplete");
+    }
+
+    if (!out.cross_fields.empty()) {
+        if (out.crosses.size() != out.cross_fields.size() || out.cross_width < 0 || out.cross_buckets == 0 ||
+            std::find(out.crosses.cbegin(), out.crosses.cend(), nullptr) != out.crosses.cend()) {
+            return rocksdb::Status::InvalidArgument("cross buffers are incomplete");
+        }
+    }
+
+    FillFn fn = nullptr;
+    switch (out.id_dtype) {
+        case DType::kInt32:
+            fn = select_label_dtype<int32_t>(out.label_dtype, out.value_dtype);
+            break;
+        case DType::kInt64:
+            fn = select_label_dtype<int64_t>(out.label_dtype, out.value_dtype);
+            break;
+        default:
+            break;
+    }
+
+    if (!fn) {
+        return rocksdb::Status::InvalidArgument("unsupported output dtypes");
+    }
+
+    (this->*fn)(batch, out, parallel_for);
+    return rocksdb::Status::OK();
+}
+
+rocksdb::Status
+Reader::fill_batch(uint32_t const* example_ids, size_t const n, OutputBuffers const& out) const
+{
+    Batch batch;
+    auto status = read(example_ids, n, batch);
+    if (!status.ok()) {
+        return status;
+    }
+
+    return fill(batch, out);
+}
+
+int32_t
+Reader::pad_width(Batch const& batch, int32_t const max_feats, std::vector<int32_t> const& boundaries)
+{
+    if (boundaries.empty()) {
+        return max_feats;
+    }
+
+    int32_t longest = 0;
+    for (size_t i = 0; i < batch.examples.size(); ++i) {
+        auto const len = static_cast<int32_t>(feature_len(batch, i));
+        longest = std::max(longest, std::min(len, max_feats));
+    }
+
+    return bucket_width(boundaries, longest, max_feats);
+}
+
+int64_t
+Reader::vocab_id(uint32_t const field_id, uint32_t const feat_id) const
+{
+    auto const field_it = vocab_.find(field_id);
+    if (field_it == vocab_.cend()) {
+        return 0L;
+    }
+
+    auto const feat_it = field_it->second.find(feat_id);
+    if (feat_it == field_it->second.cend()) {
+        return 0L;
+    }
+
+    return feat_it->second;
+}
+
+uint32_t
+Reader::feature_len(Batch const& batch, size_t const i)
+{
+    auto len = batch.examples[i]->feats()->Length();
+    if (batch.comm_feats[i]) {
+        len += batch.comm_feats[i]->feats()->Length();
+    }
+
+    return len;
+}
+
+rocksdb::Status
+Reader::read_vocab(std::string const& path)
+{
+    if (::access(path.c_str(), R_OK) < 0) {
+        char buf[1024];
+        return rocksdb::Status::IOError(path, strerror_r(errno, buf, sizeof(buf)));
+    }
+
+    std::ifstream ifs(path, std::ios::binary);
+    std::vector<char> buffer{ std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>() };
+    auto vocab = GetVocab(buffer.data());
+    if (!vocab || !vocab->entries()) {
+        return rocksdb::Status::Corruption("read vocab failed: vocab has not entries");
+    }
+
+    for (auto const& entry : *vocab->entries()) {
+        auto const field_id = static_cast<int64_t>(entry->field_id());
+        auto const feat_id = static_cast<int64_t>(entry->feat_id());
+        auto const vocab_id = static_cast<int64_t>(entry->vocab_id());
+        vocab_[field_id][feat_id] = vocab_id;
+    }
+
+    return rocksdb::Status::OK();
+}
+
+rocksdb::Status
+Reader::read_db(std::shared_ptr<rocksdb::DB> const& db,
+                std::vector<rocksdb::Slice> const& keys,
+                PinnedValues& values,
+                std::vector<rocksdb::Status>& statuses) const
+{
+    auto const n = keys.size();
+    statuses.resize(n);
+    // values stay pinned in the block cache instead of being copied out
+    db->MultiGet(read_opts_, db->DefaultColumnFamily(), n, keys.data(), values.reset(n), statuses.data(), true);
+
+    for (size_t i = 0; i < n; ++i) {
+        auto const& s = statuses[i];
+        if (!s.ok()) {
+            return rocksdb::Status::Corruption(s.ToString() + ": key = " + keys[i].ToString(true));
+        }
+    }
+
+    return rocksdb::Status::OK();
+}
+
+rocksdb::Status
+open_readonly_db(std::string const& path, DbProfile const& profile, std::shared_ptr<rocksdb::DB>* db)
+{
+    rocksdb::Options opt;
+    auto status = read_db_options(profile, &opt);
+    if (!status.ok()) {
+        return status;
+    }
+
+    rocksdb::DB* raw;
+    status = rocksdb::DB::OpenForReadOnly(opt, path, &raw);
+    if (status.ok()) {
+        db->reset(raw);
+    }
+    return status;
+}
+}
@@ -0,0 +1,198 @@
+#ifndef __ALICCP_READER_H__
+#define __ALICCP_READER_H__
+
+#include "aliccp_key.h"
+#include "aliccp_options.h"
+#include "aliccp_snapshot.h"
+#include "comm_feats_generated.h"
+#include "example_generated.h"
+#include "thread_pool.h"
+#include <functional>
+#include <memory>
+#include <rocksdb/db.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace aliccp {
+
+// grow-only array of values pinned by MultiGet, PinnableSlice can't be copied
+class PinnedValues
+{
+  public:
+    // unpins the previous values, keeps the storage when it is large enough
+    rocksdb::PinnableSlice* reset(size_t const n)
+    {
+        release();
+        if (n > capacity_) {
+            values_.reset(new rocksdb::PinnableSlice[n]);
+            capacity_ = n;
+        }
+        size_ = n;
+        return values_.get();
+    }
+
+    void release()
+    {
+        for (size_t i = 0; i < size_; ++i) {
+            values_[i].Reset();
+        }
+        size_ = 0;
+    }
+
+    rocksdb::PinnableSlice const& operator[](size_t const i) const { return values_[i]; }
+
+  private:
+    std::unique_ptr<rocksdb::PinnableSlice[]> values_;
+    size_t capacity_ = 0;
+    size_t size_ = 0;
+};
+
+// decoded examples of one batch, the flatbuffers point into the values pinned in the block cache
+// so they are valid until the batch is released or read into again. a snapshot reader pins
+// nothing and points into its mapping instead. a batch can be reused across reads to keep its
+// scratch buffers.
+struct Batch
+{
+    std::vector<const Example*> examples;
+    // comm feature of every example, nullptr if the example has none
+    std::vector<const CommFeature*> comm_feats;
+
+    // in key order
+    PinnedValues example_values;
+    PinnedValues comm_feat_values;
+
+    // scratch of Reader::read
+    std::vector<uint32_t> order;
+    std::vector<char> key_bytes;
+    std::vector<rocksdb::Slice> keys;
+    std::vector<rocksdb::Status> statuses;
+
+    // unpins the values and keeps the scratch, the flatbuffers are invalid afterwards
+    void release()
+    {
+        example_values.release();
+        comm_feat_values.release();
+        examples.clear();
+        comm_feats.clear();
+    }
+};
+
+enum class DType : int
+{
+    kInt32 = 0,
+    kInt64 = 1,
+    kUInt8 = 2,
+    kFloat16 = 3,
+    kBFloat16 = 4,
+    kFloat32 = 5,
+};
+
+// caller-owned outputs of Reader::fill, row major. feat_field_id, feat_id and values are
+// [n, width], y, z and lens are [n]. feat_field_id, feat_id and lens use id_dtype.
+struct OutputBuffers
+{
+    void* feat_field_id = nullptr;
+    void* feat_id = nullptr;
+    void* values = nullptr;
+    void* y = nullptr;
+    void* z = nullptr;
+    void* lens = nullptr;
+    DType id_dtype = DType::kInt64;
+    DType label_dtype = DType::kInt64;
+    DType value_dtype = DType::kFloat32;
+    int32_t width = 0;
+
+    // hashed crosses, crosses[c] is [n, cross_width] of id_dtype holding every (a, b) feature
+    // pair of the fields cross_fields[c] hashed into [1, cross_buckets], 0 pads
+    std::vector<std::pair<uint32_t, uint32_t>> cross_fields;
+    std::vector<void*> crosses;
+    int32_t cross_width = 0;
+    uint64_t cross_buckets = 0;
+};
+
+// smallest of the sorted boundaries that holds len, max_feats if none does
+int32_t
+bucket_width(std::vector<int32_t> const& boundaries, int32_t const len, int32_t const max_feats);
+
+// read only db with the options of profile
+rocksdb::Status
+open_readonly_db(std::string const& path, DbProfile const& profile, std::shared_ptr<rocksdb::DB>* db);
+
+// examples db + comm feats db + vocab, shared by the tensorflow op, the feature server and
+// the C api of libaliccp
+class Reader
+{
+  public:
+    // num_threads <= 0 sizes the fill pool by hardware concurrency, both dbs are opened with profile
+    static rocksdb::Status open(std::string const& examples_db,
+                                std::string const& comm_feats_db,
+                                std::string const& vocab,
+                                int const num_threads,
+                                DbProfile const& profile,
+                                std::unique_ptr<Reader>* reader);
+
+    // serves reads from a file written by export_snapshot instead of the dbs
+    static rocksdb::Status open_snapshot(std::string const& snapshot,
+                                         std::string const& vocab,
+                                         int const num_threads,
+                                         bool const populate,
+                                         bool const hugepages,
+                                         std::unique_ptr<Reader>* reader);
+
+    // one batched MultiGet for the examples, one for their deduplicated comm features, both in
+    // key order
+    rocksdb::Status read(uint32_t const* example_ids, size_t const n, Batch& batch) const;
+
+    // pad, truncate and vocab-map a batch into out, on the reader's pool unless parallel_for
+    // is given
+    rocksdb::Status fill(Batch const& batch,
+                         OutputBuffers const& out,
+                         ParallelFor const& parallel_for = nullptr) const;
+
+    // read + fill into out.width columns
+    rocksdb::Status fill_batch(uint32_t const* example_ids, size_t const n, OutputBuffers const& out) const;
+
+    // 0 if (field_id, feat_id) is not in the vocab
+    int64_t vocab_id(uint32_t const field_id, uint32_t const feat_id) const;
+
+    // features of example i before padding or truncation
+    static uint32_t feature_len(Batch const& batch, size_t const i);
+
+    // max_feats without boundaries, otherwise the bucket of the longest example of the batch
+    static int32_t pad_width(Batch const& batch,
+                             int32_t const max_feats,
+                             std::vector<int32_t> const& boundaries);
+
+  private:
+    Reader() = default;
+
+    rocksdb::Status read_vocab(std::string const& path);
+    rocksdb::Status read_snapshot(uint32_t const* example_ids, size_t const n, Batch& batch) const;
+    rocksdb::Status read_db(std::shared_ptr<rocksdb::DB> const& db,
+                            std::vector<rocksdb::Slice> const& keys,
+                            PinnedValues& values,
+                            std::vector<rocksdb::Status>& statuses) const;
+
+    using FillFn = void (Reader::*)(Batch const&, OutputBuffers const&, ParallelFor const&) const;
+
+    template<typename IdT, typename LabelT, typename ValueT>
+    void fill_rows(Batch const& batch, OutputBuffers const& out, ParallelFor const& parallel_for) const;
+
+    template<typename IdT, typename LabelT>
+    static FillFn select_value_dtype(DType const value_dtype);
+
+    template<typename IdT>
+    static FillFn select_label_dtype(DType const label_dtype, DType const value_dtype);
+
+    std::shared_ptr<rocksdb::DB> example_db_;
+    std::shared_ptr<rocksdb::DB> comm_feats_db_;
+    std::unique_ptr<Snapshot> snapshot_;
+    uint32_t key_format_ = kKeyFormatLegacy;
+    rocksdb::ReadOptions read_opts_;
+    std::unordered_map<int64_t, std::unordered_map<int64_t, int64_t>> vocab_;
+    std::unique_ptr<ThreadPool> pool_;
+};
+}
+
+#endif
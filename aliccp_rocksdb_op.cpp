@@ -1,62 +1,112 @@
 #include "Timer.h"
+#include "aliccp_reader.h"
+#include "aliccp_shard.h"
+#include "aliccp_unique.h"
 #include "comm_feats_generated.h"
 #include "example_generated.h"
 #include "feature_generated.h"
+#include "label_index_generated.h"
+#include "lens_index_generated.h"
 #include "tensorflow/core/framework/op.h"
 #include "tensorflow/core/framework/op_kernel.h"
 #include "tensorflow/core/framework/shape_inference.h"
 #include "tensorflow/core/lib/core/threadpool.h"
 #include "vocab_generated.h"
+#include <algorithm>
+#include <cmath>
 #include <errno.h>
 #include <fstream>
 #include <functional>
 #include <iterator>
-#include <rocksdb/db.h>
-#include <rocksdb/filter_policy.h>
-#include <rocksdb/options.h>
-#include <rocksdb/table.h>
+#include <limits>
+#include <mutex>
 #include <type_traits>
-#include <unordered_set>
+#include <unordered_map>
 
 #ifdef ALICCP_CUDA
 #include "field_select_kernel.h"
 #endif
 
-namespace std {
-template<>
-struct hash<rocksdb::Slice>
-{
-    size_t operator()(rocksdb::Slice const& s) const noexcept { return hash_op(s.ToString(true)); }
-
-  private:
-    std::hash<std::string> hash_op;
-};
-}
-
 namespace tensorflow {
 REGISTER_OP("AliCCPRocksDB")
     .Input("example_ids: int64")
-    .Output("feat_field_id: int64")
-    .Output("feat_id: int64")
-    .Output("features: float32")
-    .Output("y: int64")
-    .Output("z: int64")
-    .Output("lens: int64")
+    .Output("feat_field_id: id_dtype")
+    .Output("feat_id: id_dtype")
+    .Output("features: value_dtype")
+    .Output("y: label_dtype")
+    .Output("z: label_dtype")
+    .Output("lens: id_dtype")
+    .Output("crosses: num_crosses * id_dtype")
+    .Output("unique_feat_id: id_dtype")
+    .Output("feat_id_inverse: int32")
     .Attr("examples_db: string")
     .Attr("comm_feats_db: string")
     .Attr("max_feats: int")
     .Attr("vocab: string")
+    .Attr("bucket_boundaries: list(int) = []")
+    .Attr("id_dtype: {int32, int64} = DT_INT64")
+    .Attr("label_dtype: {uint8, int32, int64} = DT_INT64")
+    .Attr("value_dtype: {half, bfloat16, float} = DT_FLOAT")
+    .Attr("snapshot: string = ''")
+    .Attr("snapshot_populate: bool = false")
+    .Attr("snapshot_hugepages: bool = false")
+    .Attr("cross_fields: list(int) = []")
+    .Attr("num_crosses: int >= 0 = 0")
+    .Attr("cross_buckets: int = 1000000")
+    .Attr("max_cross_feats: int = 16")
+    .Attr("unique_ids: bool = false")
+    .Attr("db_profile: {'default', 'point_lookup'} = 'default'")
+    .Attr("db_options_file: string = ''")
+    .Attr("block_cache_mb: int = 1024")
+    .Attr("direct_reads: bool = false")
     .SetShapeFn([](shape_inference::InferenceContext* context) {
         auto example_ids = context->input(0);
-        context->set_output(0, example_ids);
-        context->set_output(1, example_ids);
-        context->set_output(2, example_ids);
+        auto matrix = context->Matrix(context->Dim(example_ids, 0), context->UnknownDim());
+        context->set_output(0, matrix);
+        context->set_output(1, matrix);
+        context->set_output(2, matrix);
         context->set_output(3, example_ids);
         context->set_output(4, example_ids);
         context->set_output(5, example_ids);
+        auto const unique_index = context->num_outputs() - 2;
+        for (auto i = 6; i < unique_index; ++i) {
+            context->set_output(i, matrix);
+        }
+        context->set_output(unique_index, context->Vector(context->UnknownDim()));
+        context->set_output(unique_index + 1, matrix);
         return Status::OK();
     });
 
+REGISTER_OP("AliCCPBucketByLength")
+    .Input("example_ids: int64")
+    .Output("bucketed_ids: int64")
+    .Output("batch_splits: int64")
+    .Output("pad_widths: int64")
+    .Attr("lens_index: string")
+    .Attr("bucket_boundaries: list(int)")
+    .Attr("batch_size: int")
+    .Attr("max_feats: int");
+
+REGISTER_OP("AliCCPNegativeSampler")
+    .Input("example_ids: int64")
+    .Input("seed: int64")
+    .Output("sampled_ids: int64")
+    .Output("weights: float32")
+    .Attr("label_index: string")
+    .Attr("label: {'y', 'z'} = 'y'")
+    .Attr("neg_rate: float");
+
+// reads the db and its output is as large as a worker's share, keep it out of constant folding
+REGISTER_OP("AliCCPShardedIds")
+    .Input("epoch: int64")
+    .Output("example_ids: int64")
+    .Attr("examples_db: string")
+    .Attr("num_workers: int")
+    .Attr("worker_index: int")
+    .Attr("ranges_per_worker: int = 8")
+    .Attr("seed: int = 0")
+    .SetIsStateful();
+
 REGISTER_OP("AliCCPFieldInfo")
     .Attr("vocab: string")
     .Output("field_id: int64")
@@ -81,6 +131,95 @@ read_vocab(std::string const& path, std::function<Status(const aliccp::Vocab*)>
     return parser(vocab);
 }
 
+static Status
+from_rocksdb(rocksdb::Status const& status)
+{
+    if (status.ok()) {
+        return Status::OK();
+    }
+
+    auto const code = status.IsInvalidArgument() ? error::INVALID_ARGUMENT : error::DATA_LOSS;
+    return Status(code, status.ToString());
+}
+
+static Status
+to_aliccp_dtype(DataType const dtype, aliccp::DType* out)
+{
+    switch (dtype) {
+        case DT_INT32:
+            *out = aliccp::DType::kInt32;
+            return Status::OK();
+        case DT_INT64:
+            *out = aliccp::DType::kInt64;
+            return Status::OK();
+        case DT_UINT8:
+            *out = aliccp::DType::kUInt8;
+            return Status::OK();
+        case DT_HALF:
+            *out = aliccp::DType::kFloat16;
+            return Status::OK();
+        case DT_BFLOAT16:
+            *out = aliccp::DType::kBFloat16;
+            return Status::OK();
+        case DT_FLOAT:
+            *out = aliccp::DType::kFloat32;
+            return Status::OK();
+        default:
+            return Status(error::INVALID_ARGUMENT, "unsupported output dtype");
+    }
+}
+
+static Status
+read_file(std::string const& path, std::vector<char>& buffer)
+{
+    if (::access(path.c_str(), R_OK) < 0) {
+        char buf[1024];
+        return Status(error::DATA_LOSS, strerror_r(errno, buf, sizeof(buf)));
+    }
+
+    std::ifstream ifs(path, std::ios::binary);
+    buffer.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+    return Status::OK();
+}
+
+static Status
+read_lens_index(std::string const& path, std::vector<char>& buffer, aliccp::LenIndex const** index)
+{
+    TF_RETURN_IF_ERROR(read_file(path, buffer));
+    *index = aliccp::GetLenIndex(buffer.data());
+    if (!*index || !(*index)->entries()) {
+        return Status(error::DATA_LOSS, "read lens index failed: index has not entries");
+    }
+
+    return Status::OK();
+}
+
+static Status
+read_label_index(std::string const& path, std::vector<char>& buffer, aliccp::LabelIndex const** index)
+{
+    TF_RETURN_IF_ERROR(read_file(path, buffer));
+    *index = aliccp::GetLabelIndex(buffer.data());
+    if (!*index || !(*index)->exists() || !(*index)->y() || !(*index)->z()) {
+        return Status(error::DATA_LOSS, "read label index failed: index has not bitmaps");
+    }
+
+    return Status::OK();
+}
+
+static Status
+check_bucket_boundaries(std::vector<int32>& boundaries)
+{
+    for (auto const boundary : boundaries) {
+        if (boundary <= 0) {
+            return Status(error::INVALID_ARGUMENT, "bucket boundaries must be positive");
+        }
+    }
+
+    std::sort(boundaries.begin(), boundaries.end());
+    boundaries.erase(std::unique(boundaries.begin(), boundaries.end()), boundaries.end());
+    return Status::OK();
+}
+
 static Tensor*
 alloc_tensor(OpKernelContext* context, std::vector<int32> const& dims, int const i)
 {
@@ -154,153 +293,356 @@ class AliCCPFieldInfoOp : public OpKernel
     std::unordered_map<int64, std::pair<int64, int64>> infos_;
 };
 
-class AliCCPRocksDBOp : public OpKernel
+class AliCCPBucketByLengthOp : public OpKernel
 {
   public:
-    explicit AliCCPRocksDBOp(OpKernelConstruction* context)
+    explicit AliCCPBucketByLengthOp(OpKernelConstruction* context)
         : OpKernel(context)
     {
-        std::string examples_db;
-        OP_REQUIRES_OK(context, context->GetAttr("examples_db", &examples_db));
-
-        std::string comm_feats_db;
-        std::string vocab;
-        OP_REQUIRES_OK(context, context->GetAttr("comm_feats_db", &comm_feats_db));
+        std::string lens_index;
+        OP_REQUIRES_OK(context, context->GetAttr("lens_index", &lens_index));
+        OP_REQUIRES_OK(context, context->GetAttr("bucket_boundaries", &boundaries_));
+        OP_REQUIRES_OK(context, context->GetAttr("batch_size", &batch_size_));
         OP_REQUIRES_OK(context, context->GetAttr("max_feats", &max_feats_));
-        OP_REQUIRES_OK(context, context->GetAttr("vocab", &vocab));
+        OP_REQUIRES(context, batch_size_ > 0, Status(error::INVALID_ARGUMENT, "batch_size must be positive"));
+        OP_REQUIRES_OK(context, check_bucket_boundaries(boundaries_));
+        OP_REQUIRES_OK(context, read_lens_index(lens_index, buffer_, &index_));
+    }
 
-        auto parse_vocab_op = [this](aliccp::Vocab const* vocab) {
-            auto entries = vocab->entries();
-            if (!entries) {
-                return Status(error::DATA_LOSS, "read vocab failed: vocab has not entries");
+    void Compute(OpKernelContext* context) override
+    {
+        auto const input = context->input(0);
+        if (input.dims() != 1) {
+            context->CtxFailure(
+                __FILE__, __LINE__, Status(error::INVALID_ARGUMENT, "1d tensor is accepted only."));
+            return;
+        }
+
+        auto const input_flat = input.flat<int64>();
+        auto const nelems = static_cast<int32>(input.NumElements());
+        auto const nbuckets = boundaries_.size() + 1;
+
+        // ids keep their input order inside a bucket, so a shuffled input stays shuffled
+        std::vector<std::vector<int64>> buckets(nbuckets);
+        for (auto i = 0; i < nelems; ++i) {
+            auto const it = std::lower_bound(boundaries_.cbegin(), boundaries_.cend(), lookup_len(input_flat(i)));
+            buckets[std::distance(boundaries_.cbegin(), it)].push_back(input_flat(i));
+        }
+
+        std::vector<int64> splits{ 0 };
+        std::vector<int64> widths;
+        for (auto b = 0; b < nbuckets; ++b) {
+            auto const width = b < boundaries_.size() ? std::min(boundaries_[b], max_feats_) : max_feats_;
+            for (auto start = 0; start < buckets[b].size(); start += batch_size_) {
+                auto const end = std::min(start + batch_size_, (int32)buckets[b].size());
+                splits.push_back(splits.back() + end - start);
+                widths.push_back(width);
             }
+        }
 
-            for (auto const& entry : *entries) {
-                auto const field_id = static_cast<int64>(entry->field_id());
-                auto const feat_id = static_cast<int64>(entry->feat_id());
-                auto const vocab_id = static_cast<int64>(entry->vocab_id());
-                vocab_[field_id][feat_id] = vocab_id;
+        auto ids_tensor = alloc_tensor(context, { nelems }, 0);
+        auto splits_tensor = alloc_tensor(context, { (int32)splits.size() }, 1);
+        auto widths_tensor = alloc_tensor(context, { (int32)widths.size() }, 2);
+        if (!ids_tensor || !splits_tensor || !widths_tensor) {
+            return;
+        }
+
+        auto ids_flat = ids_tensor->flat<int64>();
+        auto k = 0;
+        for (auto const& bucket : buckets) {
+            for (auto const id : bucket) {
+                ids_flat(k++) = id;
             }
+        }
+        std::copy(splits.cbegin(), splits.cend(), splits_tensor->flat<int64>().data());
+        std::copy(widths.cbegin(), widths.cend(), widths_tensor->flat<int64>().data());
+    }
 
-            return Status::OK();
-        };
+  private:
+    // ids missing from the index fall into the widest bucket
+    int32 lookup_len(int64 const example_id) const
+    {
+        auto const entries = index_->entries();
+        // struct vectors are stored inline, Data() is the first LenEntry
+        auto const begin = reinterpret_cast<aliccp::LenEntry const*>(entries->Data());
+        auto const end = begin + entries->size();
+        auto it = std::lower_bound(begin, end, example_id, [](aliccp::LenEntry const& entry, int64 const id) {
+            return entry.example_id() < id;
+        });
 
-        OP_REQUIRES_OK(context, read_vocab(vocab, std::move(parse_vocab_op)));
+        if (it == end || it->example_id() != example_id) {
+            return max_feats_;
+        }
 
-        rocksdb::DB* db;
-        auto status = open_db(examples_db.c_str(), &db);
-        if (!status.ok()) {
-            context->CtxFailure(__FILE__, __LINE__, Status(error::INVALID_ARGUMENT, status.ToString()));
+        return static_cast<int32>(std::min(it->len(), (uint32_t)max_feats_));
+    }
+
+    std::vector<char> buffer_;
+    aliccp::LenIndex const* index_ = nullptr;
+    std::vector<int32> boundaries_;
+    int32 batch_size_;
+    int32 max_feats_;
+};
+
+class AliCCPNegativeSamplerOp : public OpKernel
+{
+  public:
+    explicit AliCCPNegativeSamplerOp(OpKernelConstruction* context)
+        : OpKernel(context)
+    {
+        std::string label_index;
+        std::string label;
+        OP_REQUIRES_OK(context, context->GetAttr("label_index", &label_index));
+        OP_REQUIRES_OK(context, context->GetAttr("label", &label));
+        OP_REQUIRES_OK(context, context->GetAttr("neg_rate", &neg_rate_));
+        OP_REQUIRES(context,
+                    neg_rate_ > 0.0f && neg_rate_ <= 1.0f,
+                    Status(error::INVALID_ARGUMENT, "neg_rate must be in (0, 1]"));
+        OP_REQUIRES_OK(context, read_label_index(label_index, buffer_, &index_));
+        labels_ = label == "y" ? index_->y() : index_->z();
+    }
+
+    void Compute(OpKernelContext* context) override
+    {
+        auto const input = context->input(0);
+        auto const seed_tensor = context->input(1);
+        if (input.dims() != 1 || seed_tensor.dims() != 0) {
+            context->CtxFailure(
+                __FILE__, __LINE__, Status(error::INVALID_ARGUMENT, "1d ids and scalar seed are accepted only."));
+            return;
         }
-        example_db_ = std::shared_ptr<rocksdb::DB>(db);
 
-        status = open_db(comm_feats_db.c_str(), &db);
-        if (!status.ok()) {
-            context->CtxFailure(__FILE__, __LINE__, Status(error::INVALID_ARGUMENT, status.ToString()));
+        auto const input_flat = input.flat<int64>();
+        auto const seed = static_cast<uint64_t>(seed_tensor.scalar<int64>()());
+        auto const nelems = input.NumElements();
+        auto const neg_weight = 1.0f / neg_rate_;
+        // keep a negative iff its hash falls under neg_rate, so the choice only depends on
+        // (seed, example_id) and every worker agrees on it without reading the example
+        auto const threshold = neg_rate_ >= 1.0f
+                                   ? std::numeric_limits<uint64_t>::max()
+                                   : static_cast<uint64_t>(std::ldexp(static_cast<double>(neg_rate_), 64));
+
+        std::vector<int64> sampled;
+        std::vector<float> weights;
+        sampled.reserve(nelems);
+        weights.reserve(nelems);
+        for (auto i = 0; i < nelems; ++i) {
+            auto const example_id = input_flat(i);
+            if (!is_negative(example_id)) {
+                sampled.push_back(example_id);
+                weights.push_back(1.0f);
+            } else if (mix(seed ^ mix(static_cast<uint64_t>(example_id))) <= threshold) {
+                sampled.push_back(example_id);
+                weights.push_back(neg_weight);
+            }
+        }
+
+        auto ids_tensor = alloc_tensor(context, { (int32)sampled.size() }, 0);
+        auto weights_tensor = alloc_tensor(context, { (int32)weights.size() }, 1);
+        if (!ids_tensor || !weights_tensor) {
+            return;
         }
-        comm_feats_db_ = std::shared_ptr<rocksdb::DB>(db);
+
+        std::copy(sampled.cbegin(), sampled.cend(), ids_tensor->flat<int64>().data());
+        std::copy(weights.cbegin(), weights.cend(), weights_tensor->flat<float>().data());
     }
 
-    void parse_examples(OpKernelContext* context,
-                        std::vector<const aliccp::Example*> const& examples,
-                        std::unordered_map<std::string, const aliccp::CommFeature*> const& comm_feats,
-                        Tensor* field_id_tensor,
-                        Tensor* feat_id_tensor,
-                        Tensor* feats_tensor,
-                        Tensor* y,
-                        Tensor* z,
-                        Tensor* lens_tensor)
+  private:
+    // splitmix64 finalizer
+    static uint64_t mix(uint64_t x)
     {
-        auto feat_matrix = feats_tensor->matrix<float>();
-        auto field_id_matrix = field_id_tensor->matrix<int64>();
-        auto feat_id_matrix = feat_id_tensor->matrix<int64>();
-
-        auto batch_size = 64;
-        auto batch_nums = (examples.size() + batch_size - 1) / batch_size;
-
-        auto map_to_vocab_id = [this](int64 const field_id, int64 const feat_id) -> int64 {
-            auto const& vocab = vocab_;
-            auto const field_it = vocab.find(field_id);
-            if (field_it == vocab.cend()) {
-                return 0L;
-            }
+        x += 0x9e3779b97f4a7c15ULL;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
 
-            auto const feat_it = field_it->second.find(feat_id);
-            if (feat_it == field_it->second.cend()) {
-                return 0L;
-            }
+    static bool test_bit(flatbuffers::Vector<uint8_t> const* bitmap, int64 const i)
+    {
+        if (i < 0 || static_cast<uint64_t>(i / 8) >= bitmap->size()) {
+            return false;
+        }
 
-            return feat_it->second;
-        };
+        return (bitmap->Get(i / 8) >> (i % 8)) & 1;
+    }
+
+    // ids missing from the index are never dropped
+    bool is_negative(int64 const example_id) const
+    {
+        return test_bit(index_->exists(), example_id) && !test_bit(labels_, example_id);
+    }
+
+    std::vector<char> buffer_;
+    aliccp::LabelIndex const* index_ = nullptr;
+    flatbuffers::Vector<uint8_t> const* labels_ = nullptr;
+    float neg_rate_;
+};
+
+class AliCCPShardedIdsOp : public OpKernel
+{
+  public:
+    explicit AliCCPShardedIdsOp(OpKernelConstruction* context)
+        : OpKernel(context)
+    {
+        std::string examples_db;
+        int32 ranges_per_worker;
+        int64 seed;
+        OP_REQUIRES_OK(context, context->GetAttr("examples_db", &examples_db));
+        OP_REQUIRES_OK(context, context->GetAttr("num_workers", &num_workers_));
+        OP_REQUIRES_OK(context, context->GetAttr("worker_index", &worker_index_));
+        OP_REQUIRES_OK(context, context->GetAttr("ranges_per_worker", &ranges_per_worker));
+        OP_REQUIRES_OK(context, context->GetAttr("seed", &seed));
+        OP_REQUIRES(context,
+                    num_workers_ > 0 && worker_index_ >= 0 && worker_index_ < num_workers_ && ranges_per_worker > 0,
+                    Status(error::INVALID_ARGUMENT,
+                           "expect 0 <= worker_index < num_workers and ranges_per_worker > 0"));
+        seed_ = static_cast<uint64_t>(seed);
+
+        auto status = aliccp::open_readonly_db(examples_db, aliccp::DbProfile(), &db_);
+        OP_REQUIRES(context, status.ok(), Status(error::INVALID_ARGUMENT, examples_db + ": " + status.ToString()));
+        status = aliccp::read_key_format(db_.get(), &key_format_);
+        OP_REQUIRES(context, status.ok(), Status(error::INVALID_ARGUMENT, examples_db + ": " + status.ToString()));
+        OP_REQUIRES_OK(context,
+                       from_rocksdb(aliccp::split_key_ranges(db_.get(), num_workers_ * ranges_per_worker, &ranges_)));
+    }
+
+    void Compute(OpKernelContext* context) override
+    {
+        auto const epoch_tensor = context->input(0);
+        if (epoch_tensor.dims() != 0) {
+            context->CtxFailure(__FILE__, __LINE__, Status(error::INVALID_ARGUMENT, "scalar epoch is accepted only."));
+            return;
+        }
+
+        auto const epoch = epoch_tensor.scalar<int64>()();
+        std::vector<std::shared_ptr<std::vector<uint32_t>>> owned;
+        size_t total = 0;
+        for (auto const i : aliccp::worker_ranges(ranges_.size(), num_workers_, worker_index_, seed_, epoch)) {
+            std::shared_ptr<std::vector<uint32_t>> ids;
+            OP_REQUIRES_OK(context, lookup_range(i, &ids));
+            total += ids->size();
+            owned.push_back(ids);
+        }
 
-        auto parse_batch = [this,
-                            batch_size,
-                            examples,
-                            comm_feats,
-                            &field_id_matrix,
-                            &feat_matrix,
-                            &feat_id_matrix,
-                            &y,
-                            &z,
-                            &lens_tensor,
-                            &map_to_vocab_id](Eigen::Index start, Eigen::Index end) {
-            start = std::min(start * batch_size, (Eigen::Index)examples.size());
-            end = std::min(end * batch_size, (Eigen::Index)examples.size());
-
-            for (auto i = start; i < end; ++i) {
-                auto const example = examples[i];
-                if (!example) {
-                    continue;
-                }
-
-                y->flat<int64>()(i) = static_cast<int64>(example->y());
-                z->flat<int64>()(i) = static_cast<int64>(example->z());
-
-                auto feats = example->feats();
-
-                int k = 0;
-                int len = std::min((int32)feats->Length(), max_feats_);
-                for (; k < len; ++k) {
-                    auto feat = feats->Get(k);
-                    auto field_id = feat->feat_field_id();
-                    auto feat_id = feat->feat_id();
-                    auto value = feat->value();
-
-                    feat_matrix(i, k) = value;
-                    field_id_matrix(i, k) = static_cast<int64>(field_id);
-                    feat_id_matrix(i, k) = map_to_vocab_id(field_id, feat_id);
-                }
-
-                auto comm_feat_id = example->comm_feat_id();
-                auto iter = comm_feats.find(comm_feat_id->str());
-
-                if (iter != comm_feats.cend()) {
-                    auto const comm_feat = iter->second->feats();
-                    auto cap = std::min(max_feats_, (int32)(comm_feat->Length() + feats->Length()));
-                    for (; k < cap; ++k) {
-                        auto feat = comm_feat->Get(k - len);
-                        auto field_id = feat->feat_field_id();
-                        auto feat_id = feat->feat_id();
-                        auto value = feat->value();
-
-                        feat_matrix(i, k) = value;
-                        field_id_matrix(i, k) = static_cast<int64>(field_id);
-                        feat_id_matrix(i, k) = map_to_vocab_id(field_id, feat_id);
-                    }
-                }
-
-                lens_tensor->flat<int64>()(i) = k;
-                for (; k < max_feats_; ++k) {
-                    feat_matrix(i, k) = 0.0;
-                    field_id_matrix(i, k) = 0;
-                    feat_id_matrix(i, k) = 0;
-                }
+        auto ids_tensor = alloc_tensor(context, { (int32)total }, 0);
+        if (!ids_tensor) {
+            return;
+        }
+
+        auto out = ids_tensor->flat<int64>().data();
+        for (auto const& ids : owned) {
+            out = std::copy(ids->cbegin(), ids->cend(), out);
+        }
+    }
+
+  private:
+    // ranges move between workers across epochs, so every scanned range is kept, at most
+    // 4 bytes per example of the db
+    Status lookup_range(size_t const i, std::shared_ptr<std::vector<uint32_t>>* ids)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = cache_.find(i);
+            if (it != cache_.cend()) {
+                *ids = it->second;
+                return Status::OK();
             }
-        };
+        }
 
-        auto thread_pool = context->device()->tensorflow_cpu_worker_threads()->workers;
-        auto cost_per_unit = 10 * 6000 * batch_size;
-        thread_pool->ParallelFor(batch_nums, cost_per_unit, std::move(parse_batch));
+        std::shared_ptr<std::vector<uint32_t>> scanned(new std::vector<uint32_t>());
+        auto status = from_rocksdb(aliccp::range_ids(db_.get(), ranges_[i], key_format_, scanned.get()));
+        if (!status.ok()) {
+            return status;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        *ids = cache_.emplace(i, scanned).first->second;
+        return Status::OK();
+    }
+
+    std::shared_ptr<rocksdb::DB> db_;
+    uint32_t key_format_;
+    std::vector<aliccp::KeyRange> ranges_;
+    int32 num_workers_;
+    int32 worker_index_;
+    uint64_t seed_;
+    std::mutex mutex_;
+    std::unordered_map<size_t, std::shared_ptr<std::vector<uint32_t>>> cache_;
+};
+
+class AliCCPRocksDBOp : public OpKernel
+{
+  public:
+    explicit AliCCPRocksDBOp(OpKernelConstruction* context)
+        : OpKernel(context)
+    {
+        std::string examples_db;
+        OP_REQUIRES_OK(context, context->GetAttr("examples_db", &examples_db));
+
+        std::string comm_feats_db;
+        std::string vocab;
+        OP_REQUIRES_OK(context, context->GetAttr("comm_feats_db", &comm_feats_db));
+        OP_REQUIRES_OK(context, context->GetAttr("max_feats", &max_feats_));
+        OP_REQUIRES_OK(context, context->GetAttr("vocab", &vocab));
+        OP_REQUIRES_OK(context, context->GetAttr("bucket_boundaries", &boundaries_));
+        OP_REQUIRES_OK(context, check_bucket_boundaries(boundaries_));
+
+        DataType id_dtype;
+        DataType label_dtype;
+        DataType value_dtype;
+        OP_REQUIRES_OK(context, context->GetAttr("id_dtype", &id_dtype));
+        OP_REQUIRES_OK(context, context->GetAttr("label_dtype", &label_dtype));
+        OP_REQUIRES_OK(context, context->GetAttr("value_dtype", &value_dtype));
+        OP_REQUIRES_OK(context, to_aliccp_dtype(id_dtype, &id_dtype_));
+        OP_REQUIRES_OK(context, to_aliccp_dtype(label_dtype, &label_dtype_));
+        OP_REQUIRES_OK(context, to_aliccp_dtype(value_dtype, &value_dtype_));
+
+        std::vector<int32> cross_fields;
+        int32 num_crosses;
+        int64 cross_buckets;
+        OP_REQUIRES_OK(context, context->GetAttr("cross_fields", &cross_fields));
+        OP_REQUIRES_OK(context, context->GetAttr("num_crosses", &num_crosses));
+        OP_REQUIRES_OK(context, context->GetAttr("cross_buckets", &cross_buckets));
+        OP_REQUIRES_OK(context, context->GetAttr("max_cross_feats", &max_cross_feats_));
+        OP_REQUIRES_OK(context, context->GetAttr("unique_ids", &unique_ids_));
+        OP_REQUIRES(context,
+                    cross_fields.size() == 2 * static_cast<size_t>(num_crosses),
+                    Status(error::INVALID_ARGUMENT, "cross_fields must hold num_crosses pairs of field ids"));
+        auto const max_bucket = id_dtype == DT_INT32 ? std::numeric_limits<int32>::max()
+                                                     : std::numeric_limits<int64>::max();
+        OP_REQUIRES(context,
+                    cross_buckets > 0 && cross_buckets <= max_bucket && max_cross_feats_ >= 0,
+                    Status(error::INVALID_ARGUMENT, "cross_buckets must fit id_dtype, max_cross_feats >= 0"));
+        for (auto i = 0; i < num_crosses; ++i) {
+            cross_fields_.emplace_back(cross_fields[2 * i], cross_fields[2 * i + 1]);
+        }
+        cross_buckets_ = static_cast<uint64_t>(cross_buckets);
+
+        std::string snapshot;
+        bool populate;
+        bool hugepages;
+        OP_REQUIRES_OK(context, context->GetAttr("snapshot", &snapshot));
+        OP_REQUIRES_OK(context, context->GetAttr("snapshot_populate", &populate));
+        OP_REQUIRES_OK(context, context->GetAttr("snapshot_hugepages", &hugepages));
+
+        std::string profile_name;
+        aliccp::DbProfile profile;
+        OP_REQUIRES_OK(context, context->GetAttr("db_profile", &profile_name));
+        OP_REQUIRES_OK(context, context->GetAttr("db_options_file", &profile.options_file));
+        OP_REQUIRES_OK(context, context->GetAttr("block_cache_mb", &profile.block_cache_mb));
+        OP_REQUIRES_OK(context, context->GetAttr("direct_reads", &profile.direct_reads));
+        OP_REQUIRES_OK(context, from_rocksdb(aliccp::parse_db_profile(profile_name, &profile.kind)));
+
+        // rows are filled on the tensorflow worker pool, the reader's own pool stays minimal
+        if (snapshot.empty()) {
+            OP_REQUIRES_OK(
+                context,
+                from_rocksdb(aliccp::Reader::open(examples_db, comm_feats_db, vocab, 1, profile, &reader_)));
+        } else {
+            OP_REQUIRES_OK(
+                context,
+                from_rocksdb(aliccp::Reader::open_snapshot(snapshot, vocab, 1, populate, hugepages, &reader_)));
+        }
     }
 
     void Compute(OpKernelContext* context) override
@@ -313,14 +655,22 @@ class AliCCPRocksDBOp : public OpKernel
             return;
         }
 
-        std::vector<std::string> buf;
-        OP_REQUIRES_OK(context, read_values(input, buf));
-
         auto const nelems = static_cast<int32>(input.NumElements());
+        auto const input_flat = input.flat<int64>();
+        auto scratch = acquire_scratch();
+        auto& example_ids = scratch->example_ids;
+        auto& batch = scratch->batch;
+        example_ids.resize(nelems);
+        for (auto i = 0; i < nelems; ++i) {
+            example_ids[i] = static_cast<uint32_t>(input_flat(i));
+        }
+
+        OP_REQUIRES_OK(context, from_rocksdb(reader_->read(example_ids.data(), example_ids.size(), batch)));
 
-        auto field_id_tensor = alloc_tensor(context, { nelems, max_feats_ }, 0);
-        auto feat_id_tensor = alloc_tensor(context, { nelems, max_feats_ }, 1);
-        auto feats_tensor = alloc_tensor(context, { nelems, max_feats_ }, 2);
+        auto const width = aliccp::Reader::pad_width(batch, max_feats_, boundaries_);
+        auto field_id_tensor = alloc_tensor(context, { nelems, width }, 0);
+        auto feat_id_tensor = alloc_tensor(context, { nelems, width }, 1);
+        auto feats_tensor = alloc_tensor(context, { nelems, width }, 2);
         auto y = alloc_tensor(context, { nelems }, 3);
         auto z = alloc_tensor(context, { nelems }, 4);
         auto lens_tensor = alloc_tensor(context, { nelems }, 5);
@@ -329,117 +679,121 @@ class AliCCPRocksDBOp : public OpKernel
             return;
         }
 
-        std::vector<const aliccp::Example*> examples;
-        std::transform(buf.cbegin(), buf.cend(), std::back_inserter(examples), [](std::string const& s) {
-            return aliccp::GetExample(s.data());
-        });
+        std::vector<void*> crosses;
+        for (size_t c = 0; c < cross_fields_.size(); ++c) {
+            auto cross_tensor = alloc_tensor(context, { nelems, max_cross_feats_ }, 6 + c);
+            if (!cross_tensor) {
+                return;
+            }
+            crosses.push_back(cross_tensor->data());
+        }
 
-        std::unordered_set<rocksdb::Slice> comm_keys;
-        std::transform(examples.cbegin(),
-                       examples.cend(),
-                       std::inserter(comm_keys, comm_keys.end()),
-                       [](const aliccp::Example* example) {
-                           auto key = rocksdb::Slice(example->comm_feat_id()->c_str(),
-                                                     example->comm_feat_id()->Length());
-                           return key;
-                       });
-
-        std::vector<string> comm_feats_buf;
-        std::unordered_map<std::string, const aliccp::CommFeature*> comm_feats;
-        OP_REQUIRES_OK(context,
-                       read_db(comm_feats_db_,
-                               read_opts_,
-                               std::vector<rocksdb::Slice>(comm_keys.begin(), comm_keys.end()),
-                               comm_feats_buf));
-
-        std::transform(comm_feats_buf.cbegin(),
-                       comm_feats_buf.cend(),
-                       std::inserter(comm_feats, comm_feats.end()),
-                       [](std::string const& s) {
-                           auto comm_feat = aliccp::GetCommFeature(s.data());
-                           return std::make_pair(comm_feat->comm_feat_id()->str(), comm_feat);
-                       });
+        aliccp::OutputBuffers out;
+        out.feat_field_id = field_id_tensor->data();
+        out.feat_id = feat_id_tensor->data();
+        out.values = feats_tensor->data();
+        out.y = y->data();
+        out.z = z->data();
+        out.lens = lens_tensor->data();
+        out.id_dtype = id_dtype_;
+        out.label_dtype = label_dtype_;
+        out.value_dtype = value_dtype_;
+        out.width = width;
+        out.cross_fields = cross_fields_;
+        out.crosses = crosses;
+        out.cross_width = max_cross_feats_;
+        out.cross_buckets = cross_buckets_;
+
+        auto thread_pool = context->device()->tensorflow_cpu_worker_threads()->workers;
+        aliccp::ParallelFor parallel_for =
+            [thread_pool](int64_t total, int64_t cost_per_unit, std::function<void(int64_t, int64_t)> const& fn) {
+                thread_pool->ParallelFor(total, cost_per_unit, [&fn](int64 start, int64 end) { fn(start, end); });
+            };
 
         Timer timer;
-        parse_examples(
-            context, examples, comm_feats, field_id_tensor, feat_id_tensor, feats_tensor, y, z, lens_tensor);
+        OP_REQUIRES_OK(context, from_rocksdb(reader_->fill(batch, out, parallel_for)));
+
+        // unique ids and their inverse stay empty unless asked for, the outputs always exist
+        auto const unique_index = 6 + static_cast<int>(cross_fields_.size());
+        if (!unique_ids_) {
+            alloc_tensor(context, { 0 }, unique_index);
+            alloc_tensor(context, { nelems, 0 }, unique_index + 1);
+            return;
+        }
+
+        auto inverse_tensor = alloc_tensor(context, { nelems, width }, unique_index + 1);
+        if (!inverse_tensor) {
+            return;
+        }
+
+        auto const inverse = inverse_tensor->flat<int32>().data();
+        if (id_dtype_ == aliccp::DType::kInt32) {
+            emit_unique<int32>(context, *feat_id_tensor, inverse, unique_index, parallel_for);
+        } else {
+            emit_unique<int64>(context, *feat_id_tensor, inverse, unique_index, parallel_for);
+        }
     }
 
   private:
-    Status read_db(std::shared_ptr<rocksdb::DB> db,
-                   rocksdb::ReadOptions const& opt,
-                   std::vector<rocksdb::Slice> const& keys,
-                   std::vector<std::string>& values)
+    template<typename IdT>
+    static void emit_unique(OpKernelContext* context,
+                            Tensor const& feat_ids,
+                            int32* inverse,
+                            int const index,
+                            aliccp::ParallelFor const& parallel_for)
     {
-        Timer timer;
-        auto status = db->MultiGet(opt, keys, &values);
-
-        int failed = 0;
-        for (auto i = 0; i < keys.size(); ++i) {
-            auto s = status[i];
-            if (!s.ok()) {
-                std::string msg = s.ToString() + ": key = " + keys[i].ToString(true);
-                return Status(error::DATA_LOSS, msg);
-            }
-        }
+        std::vector<IdT> unique;
+        aliccp::unique_ids(feat_ids.flat<IdT>().data(), feat_ids.NumElements(), unique, inverse, parallel_for);
 
-        return Status::OK();
+        auto unique_tensor = alloc_tensor(context, { (int32)unique.size() }, index);
+        if (!unique_tensor) {
+            return;
+        }
+        std::copy(unique.cbegin(), unique.cend(), unique_tensor->flat<IdT>().data());
     }
 
-    Status read_values(Tensor const& input, std::vector<std::string>& values)
+    struct Scratch
     {
-        auto nelems = input.NumElements();
-        auto input_flat = input.flat<int64>();
-        std::vector<rocksdb::Slice> keys;
+        std::vector<uint32_t> example_ids;
+        aliccp::Batch batch;
+    };
 
-        uint32_t* keybuf = (uint32_t*)::malloc(sizeof(uint32_t) * nelems);
-        if (!keybuf) {
-            return Status(error::INTERNAL, "malloc buf failed.");
+    // Compute runs concurrently, every call takes its own scratch and hands it back unpinned
+    // with its buffers kept for the next call
+    std::unique_ptr<Scratch, std::function<void(Scratch*)>> acquire_scratch()
+    {
+        Scratch* scratch = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(scratch_mutex_);
+            if (!scratch_pool_.empty()) {
+                scratch = scratch_pool_.back().release();
+                scratch_pool_.pop_back();
+            }
         }
 
-        for (auto i = 0; i < nelems; ++i) {
-            auto example_id = static_cast<uint32_t>(input_flat(i));
-            keybuf[i] = example_id;
-            const char* p = reinterpret_cast<const char*>(keybuf + i);
-            rocksdb::Slice key(p, sizeof(example_id));
-            keys.push_back(key);
+        if (!scratch) {
+            scratch = new Scratch();
         }
 
-        auto status = read_db(example_db_, read_opts_, keys, values);
-        free(keybuf);
-        return status;
-    }
-
-    rocksdb::Status open_db(const char* path, rocksdb::DB** db)
-    {
-        auto& opt = opt_;
-        opt.create_if_missing = false;
-        opt.max_open_files = -1;
-        opt.max_write_buffer_number = 3;
-        opt.target_file_size_base = 67108864;
-        opt.new_table_reader_for_compaction_inputs = true;
-        opt.statistics = rocksdb::CreateDBStatistics();
-        opt.stats_dump_period_sec = 10;
-        opt.compression = rocksdb::kZlibCompression;
-
-        rocksdb::BlockBasedTableOptions table_opt;
-        table_opt.block_cache = rocksdb::NewLRUCache((1024 * 1024 * 1024));
-        table_opt.block_cache_compressed = rocksdb::NewLRUCache(500 * (1024 * 1024));
-        table_opt.cache_index_and_filter_blocks = true;
-        table_opt.filter_policy.reset(rocksdb::NewBloomFilterPolicy(10, false));
-        table_opt.index_type = rocksdb::BlockBasedTableOptions::kHashSearch;
-        table_opt.block_size = 4 * 1024;
-        opt.table_factory.reset(rocksdb::NewBlockBasedTableFactory(table_opt));
-
-        return rocksdb::DB::OpenForReadOnly(opt, path, db);
+        return std::unique_ptr<Scratch, std::function<void(Scratch*)>>(scratch, [this](Scratch* s) {
+            s->batch.release();
+            std::lock_guard<std::mutex> lock(scratch_mutex_);
+            scratch_pool_.emplace_back(s);
+        });
     }
 
-    std::shared_ptr<rocksdb::DB> example_db_;
-    std::shared_ptr<rocksdb::DB> comm_feats_db_;
-    rocksdb::ReadOptions read_opts_;
-    rocksdb::Options opt_;
+    std::unique_ptr<aliccp::Reader> reader_;
+    std::mutex scratch_mutex_;
+    std::vector<std::unique_ptr<Scratch>> scratch_pool_;
     int32 max_feats_;
-    std::unordered_map<int64, std::unordered_map<int64, int64>> vocab_;
+    std::vector<int32> boundaries_;
+    aliccp::DType id_dtype_;
+    aliccp::DType label_dtype_;
+    aliccp::DType value_dtype_;
+    std::vector<std::pair<uint32_t, uint32_t>> cross_fields_;
+    uint64_t cross_buckets_;
+    int32 max_cross_feats_;
+    bool unique_ids_;
 };
 
 #ifdef ALICCP_CUDA
@@ -536,5 +890,8 @@ REGISTER_KERNEL_BUILDER(Name("AliCCPSelectField").Device(DEVICE_GPU), AliCCPSele
 
 REGISTER_KERNEL_BUILDER(Name("AliCCPRocksDB").Device(DEVICE_CPU), AliCCPRocksDBOp);
 REGISTER_KERNEL_BUILDER(Name("AliCCPFieldInfo").Device(DEVICE_CPU), AliCCPFieldInfoOp);
+REGISTER_KERNEL_BUILDER(Name("AliCCPBucketByLength").Device(DEVICE_CPU), AliCCPBucketByLengthOp);
+REGISTER_KERNEL_BUILDER(Name("AliCCPNegativeSampler").Device(DEVICE_CPU), AliCCPNegativeSamplerOp);
+REGISTER_KERNEL_BUILDER(Name("AliCCPShardedIds").Device(DEVICE_CPU), AliCCPShardedIdsOp);
 };
 
@@ -0,0 +1,293 @@
+#include "aliccp_shard.h"
+#include "aliccp_key.h"
+#include "aliccp_reader.h"
+#include <algorithm>
+#include <random>
+#include <string.h>
+
+namespace aliccp {
+
+namespace {
+// segments per requested range before they are merged, finer segments balance better
+int const kSegmentsPerRange = 8;
+int const kMaxSplitRounds = 16;
+uint64_t const kKeySpace = 1ULL << 32;
+
+// position of a 4 byte key in bytewise order, empty start is 0 and empty limit is kKeySpace
+bool
+key_order(std::string const& key, uint64_t const unbounded, uint64_t* order)
+{
+    if (key.empty()) {
+        *order = unbounded;
+        return true;
+    }
+
+    if (key.size() != sizeof(uint32_t)) {
+        return false;
+    }
+
+    uint64_t x = 0;
+    for (auto const c : key) {
+        x = (x << 8) | static_cast<uint8_t>(c);
+    }
+    *order = x;
+    return true;
+}
+
+std::string
+order_key(uint64_t order)
+{
+    std::string key(sizeof(uint32_t), '\0');
+    for (auto i = static_cast<int>(key.size()) - 1; i >= 0; --i) {
+        key[i] = static_cast<char>(order & 0xff);
+        order >>= 8;
+    }
+    return key;
+}
+
+void
+approximate_sizes(rocksdb::DB* db, std::vector<KeyRange> const& segments, std::vector<uint64_t>& sizes)
+{
+    // greater than every 4 byte key
+    static std::string const kLast(sizeof(uint32_t) + 1, '\xff');
+
+    std::vector<rocksdb::Range> ranges;
+    ranges.reserve(segments.size());
+    for (auto const& segment : segments) {
+        ranges.emplace_back(segment.start, segment.limit.empty() ? kLast : segment.limit);
+    }
+
+    sizes.assign(segments.size(), 0);
+    db->GetApproximateSizes(db->DefaultColumnFamily(), ranges.data(), (int)ranges.size(), sizes.data());
+}
+
+// halves every segment larger than target that still spans more than one key
+bool
+split_segments(std::vector<KeyRange>& segments, std::vector<uint64_t> const& sizes, uint64_t const target)
+{
+    std::vector<KeyRange> result;
+    auto split = false;
+    for (size_t i = 0; i < segments.size(); ++i) {
+        uint64_t lo;
+        uint64_t hi;
+        if (sizes[i] <= target || !key_order(segments[i].start, 0, &lo) ||
+            !key_order(segments[i].limit, kKeySpace, &hi) || hi - lo < 2) {
+            result.push_back(segments[i]);
+            continue;
+        }
+
+        auto const mid = order_key(lo + (hi - lo) / 2);
+        result.push_back(KeyRange{ segments[i].start, mid });
+        result.push_back(KeyRange{ mid, segments[i].limit });
+        split = true;
+    }
+
+    segments.swap(result);
+    return split;
+}
+
+// order of the first or last example key of the db, false if it has none
+bool
+key_bound(rocksdb::DB* db, bool const last, uint64_t* order)
+{
+    rocksdb::ReadOptions opt;
+    opt.fill_cache = false;
+    opt.total_order_seek = true;
+    std::unique_ptr<rocksdb::Iterator> iter(db->NewIterator(opt));
+    for (last ? iter->SeekToLast() : iter->SeekToFirst(); iter->Valid(); last ? iter->Prev() : iter->Next()) {
+        if (iter->key().size() == kExampleKeySize) {
+            return key_order(iter->key().ToString(), 0, order);
+        }
+    }
+    return false;
+}
+
+// cuts the span between the first and the last example key into num_ranges equal parts of the
+// key space. used when the sst files give too few cut points, e.g. a small db or one whose data
+// is still in the memtable, so every worker still gets the same number of ranges.
+void
+even_ranges(rocksdb::DB* db, int const num_ranges, std::vector<KeyRange>* ranges)
+{
+    uint64_t lo = 0;
+    uint64_t hi = kKeySpace - 1;
+    if (!key_bound(db, false, &lo) || !key_bound(db, true, &hi)) {
+        lo = 0;
+        hi = kKeySpace - 1;
+    }
+
+    auto const span = hi - lo + 1;
+    ranges->assign(1, KeyRange{ "", "" });
+    for (auto k = 1; k < num_ranges; ++k) {
+        auto const cut = order_key(lo + span * k / num_ranges);
+        ranges->back().limit = cut;
+        ranges->push_back(KeyRange{ cut, "" });
+    }
+}
+}
+
+rocksdb::Status
+split_key_ranges(rocksdb::DB* db, int const num_ranges, std::vector<KeyRange>* ranges)
+{
+    if (num_ranges <= 0) {
+        return rocksdb::Status::InvalidArgument("num_ranges must be positive");
+    }
+
+    std::vector<rocksdb::LiveFileMetaData> files;
+    db->GetLiveFilesMetaData(&files);
+
+    std::vector<std::string> cuts;
+    for (auto const& file : files) {
+        cuts.push_back(file.smallestkey);
+    }
+    std::sort(cuts.begin(), cuts.end());
+    cuts.erase(std::unique(cuts.begin(), cuts.end()), cuts.end());
+
+    // the smallest key of the db starts the first segment, which is unbounded anyway
+    std::vector<KeyRange> segments(1);
+    for (size_t i = 1; i < cuts.size(); ++i) {
+        segments.back().limit = cuts[i];
+        segments.push_back(KeyRange{ cuts[i], "" });
+    }
+
+    std::vector<uint64_t> sizes;
+    approximate_sizes(db, segments, sizes);
+    for (auto round = 0; round < kMaxSplitRounds; ++round) {
+        uint64_t total = 0;
+        for (auto const size : sizes) {
+            total += size;
+        }
+
+        auto const target = total / (static_cast<uint64_t>(num_ranges) * kSegmentsPerRange);
+        if (!split_segments(segments, sizes, target)) {
+            break;
+        }
+        approximate_sizes(db, segments, sizes);
+    }
+
+    uint64_t total = 0;
+    for (auto const size : sizes) {
+        total += size;
+    }
+
+    // merge segments into ranges at every multiple of total / num_ranges
+    ranges->clear();
+    ranges->push_back(KeyRange{ "", "" });
+    uint64_t acc = 0;
+    for (size_t i = 0; i + 1 < segments.size(); ++i) {
+        acc += sizes[i];
+        auto const k = static_cast<double>(ranges->size());
+        if (static_cast<int>(ranges->size()) < num_ranges &&
+            static_cast<double>(acc) * num_ranges >= static_cast<double>(total) * k) {
+            ranges->back().limit = segments[i].limit;
+            ranges->push_back(KeyRange{ segments[i].limit, "" });
+        }
+    }
+
+    if (static_cast<int>(ranges->size()) < num_ranges) {
+        even_ranges(db, num_ranges, ranges);
+    }
+    return rocksdb::Status::OK();
+}
+
+std::vector<size_t>
+worker_ranges(size_t const num_ranges,
+              int const num_workers,
+              int const worker_index,
+              uint64_t const seed,
+              int64_t const epoch)
+{
+    std::vector<size_t> perm(num_ranges);
+    for (size_t i = 0; i < num_ranges; ++i) {
+        perm[i] = i;
+    }
+
+    // fisher-yates on mt19937_64 directly, std::shuffle differs between standard libraries
+    std::seed_seq seq{ static_cast<uint32_t>(seed),
+                       static_cast<uint32_t>(seed >> 32),
+                       static_cast<uint32_t>(epoch),
+                       static_cast<uint32_t>(static_cast<uint64_t>(epoch) >> 32) };
+    std::mt19937_64 engine(seq);
+    for (auto i = num_ranges; i > 1; --i) {
+        std::swap(perm[i - 1], perm[engine() % i]);
+    }
+
+    std::vector<size_t> owned;
+    for (auto i = static_cast<size_t>(worker_index); i < num_ranges; i += num_workers) {
+        owned.push_back(perm[i]);
+    }
+    return owned;
+}
+
+rocksdb::Status
+range_ids(rocksdb::DB* db, KeyRange const& range, uint32_t const key_format, std::vector<uint32_t>* ids)
+{
+    rocksdb::ReadOptions opt;
+    opt.fill_cache = false;
+    opt.readahead_size = 2 * 1024 * 1024;
+    opt.total_order_seek = true;
+
+    rocksdb::Slice limit(range.limit);
+    if (!range.limit.empty()) {
+        opt.iterate_upper_bound = &limit;
+    }
+
+    std::unique_ptr<rocksdb::Iterator> iter(db->NewIterator(opt));
+    if (range.start.empty()) {
+        iter->SeekToFirst();
+    } else {
+        iter->Seek(range.start);
+    }
+
+    for (; iter->Valid(); iter->Next()) {
+        auto const key = iter->key();
+        if (key.size() != kExampleKeySize) {
+            continue;
+        }
+        ids->push_back(decode_example_key(key.data(), key_format));
+    }
+
+    return iter->status();
+}
+
+rocksdb::Status
+shard_ids(std::string const& examples_db,
+          int const num_workers,
+          int const worker_index,
+          int const ranges_per_worker,
+          uint64_t const seed,
+          int64_t const epoch,
+          std::vector<uint32_t>* ids)
+{
+    if (num_workers <= 0 || worker_index < 0 || worker_index >= num_workers || ranges_per_worker <= 0) {
+        return rocksdb::Status::InvalidArgument("expect 0 <= worker_index < num_workers and ranges_per_worker > 0");
+    }
+
+    std::shared_ptr<rocksdb::DB> db;
+    auto status = open_readonly_db(examples_db, DbProfile(), &db);
+    if (!status.ok()) {
+        return rocksdb::Status::InvalidArgument(examples_db, status.ToString());
+    }
+
+    uint32_t key_format;
+    status = read_key_format(db.get(), &key_format);
+    if (!status.ok()) {
+        return rocksdb::Status::InvalidArgument(examples_db, status.ToString());
+    }
+
+    std::vector<KeyRange> ranges;
+    status = split_key_ranges(db.get(), num_workers * ranges_per_worker, &ranges);
+    if (!status.ok()) {
+        return status;
+    }
+
+    ids->clear();
+    for (auto const i : worker_ranges(ranges.size(), num_workers, worker_index, seed, epoch)) {
+        status = range_ids(db.get(), ranges[i], key_format, ids);
+        if (!status.ok()) {
+            return status;
+        }
+    }
+
+    return rocksdb::Status::OK();
+}
+}
@@ -0,0 +1,50 @@
+#ifndef __ALICCP_SHARD_H__
+#define __ALICCP_SHARD_H__
+
+#include <memory>
+#include <rocksdb/db.h>
+#include <string>
+#include <vector>
+
+namespace aliccp {
+
+// [start, limit) in key order, an empty start or limit is unbounded
+struct KeyRange
+{
+    std::string start;
+    std::string limit;
+};
+
+// splits the examples db into num_ranges disjoint ranges covering the whole key space, balanced
+// by approximate size on disk. cuts only depend on the sst files, so workers opening the same
+// files get the same ranges. when the sst files give fewer cut points, the key span of the db is
+// cut evenly instead, ranges may then be empty if the db holds fewer keys than num_ranges.
+rocksdb::Status
+split_key_ranges(rocksdb::DB* db, int const num_ranges, std::vector<KeyRange>* ranges);
+
+// indexes of the ranges owned by worker_index in an epoch. ranges are permuted by (seed, epoch)
+// and dealt round robin, so every range goes to exactly one worker per epoch.
+std::vector<size_t>
+worker_ranges(size_t const num_ranges,
+              int const num_workers,
+              int const worker_index,
+              uint64_t const seed,
+              int64_t const epoch);
+
+// example ids of a range in key order, read with one sequential scan. key_format is the one
+// read_key_format returns for the db.
+rocksdb::Status
+range_ids(rocksdb::DB* db, KeyRange const& range, uint32_t const key_format, std::vector<uint32_t>* ids);
+
+// range_ids of worker_index in an epoch, in the order the ranges are dealt
+rocksdb::Status
+shard_ids(std::string const& examples_db,
+          int const num_workers,
+          int const worker_index,
+          int const ranges_per_worker,
+          uint64_t const seed,
+          int64_t const epoch,
+          std::vector<uint32_t>* ids);
+}
+
+#endif
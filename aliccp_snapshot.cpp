@@ -0,0 +1,88 @@
+#include "aliccp_snapshot.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace aliccp {
+
+static rocksdb::Status
+io_error(std::string const& path)
+{
+    char buf[1024];
+    return rocksdb::Status::IOError(path, strerror_r(errno, buf, sizeof(buf)));
+}
+
+rocksdb::Status
+Snapshot::open(std::string const& path, bool const populate, bool const hugepages, std::unique_ptr<Snapshot>* snapshot)
+{
+    auto fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return io_error(path);
+    }
+
+    struct stat st;
+    if (::fstat(fd, &st) < 0) {
+        auto status = io_error(path);
+        ::close(fd);
+        return status;
+    }
+
+    auto const size = static_cast<size_t>(st.st_size);
+    if (size < sizeof(SnapshotHeader)) {
+        ::close(fd);
+        return rocksdb::Status::Corruption(path, "file is smaller than the snapshot header");
+    }
+
+    auto flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    if (populate) {
+        flags |= MAP_POPULATE;
+    }
+#endif
+    auto addr = ::mmap(nullptr, size, PROT_READ, flags, fd, 0);
+    // the mapping keeps its own reference to the file
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+        return io_error(path);
+    }
+
+    std::unique_ptr<Snapshot> s(new Snapshot());
+    s->base_ = static_cast<const char*>(addr);
+    s->size_ = size;
+    s->header_ = reinterpret_cast<SnapshotHeader const*>(s->base_);
+
+    auto const header = s->header_;
+    if (header->magic != kSnapshotMagic || header->version != kSnapshotVersion) {
+        return rocksdb::Status::Corruption(path, "not a snapshot of this version");
+    }
+
+    if (header->index_offset % kSnapshotAlign != 0 || header->index_offset > size ||
+        header->num_ids > (size - header->index_offset) / sizeof(SnapshotEntry)) {
+        return rocksdb::Status::Corruption(path, "snapshot index is out of the file");
+    }
+    s->index_ = reinterpret_cast<SnapshotEntry const*>(s->base_ + header->index_offset);
+
+#ifdef MADV_HUGEPAGE
+    // only a hint, file backed huge pages depend on the filesystem and kernel config
+    if (hugepages) {
+        ::madvise(addr, size, MADV_HUGEPAGE);
+    }
+#endif
+    if (!populate) {
+        ::madvise(addr, size, MADV_RANDOM);
+    }
+
+    *snapshot = std::move(s);
+    return rocksdb::Status::OK();
+}
+
+Snapshot::~Snapshot()
+{
+    if (base_) {
+        ::munmap(const_cast<char*>(base_), size_);
+    }
+}
+}
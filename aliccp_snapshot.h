@@ -0,0 +1,80 @@
+#ifndef __ALICCP_SNAPSHOT_H__
+#define __ALICCP_SNAPSHOT_H__
+
+#include "comm_feats_generated.h"
+#include "example_generated.h"
+#include <memory>
+#include <rocksdb/status.h>
+#include <stdint.h>
+#include <string>
+
+namespace aliccp {
+
+// "ACCPSNAP"
+uint64_t const kSnapshotMagic = 0x50414e5350434341ULL;
+uint32_t const kSnapshotVersion = 1;
+// every flatbuffer and the index start at a multiple of kSnapshotAlign
+uint64_t const kSnapshotAlign = 8;
+
+// file layout, native endian: SnapshotHeader | comm feats | examples | SnapshotEntry[num_ids]
+struct SnapshotHeader
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t reserved;
+    // index has an entry for every example id in [0, num_ids)
+    uint64_t num_ids;
+    uint64_t index_offset;
+    uint64_t num_examples;
+    uint64_t num_comm_feats;
+};
+
+// file offsets of the flatbuffers of one example id, 0 if missing
+struct SnapshotEntry
+{
+    uint64_t example;
+    uint64_t comm_feat;
+};
+
+// read only mapping of a file written by export_snapshot, lookups return pointers into the
+// mapping and stay valid as long as the snapshot is alive
+class Snapshot
+{
+  public:
+    // populate faults the whole file in at open, hugepages asks for transparent huge pages
+    static rocksdb::Status open(std::string const& path,
+                                bool const populate,
+                                bool const hugepages,
+                                std::unique_ptr<Snapshot>* snapshot);
+
+    ~Snapshot();
+
+    // nullptr if the id is not in the snapshot
+    const Example* example(uint32_t const example_id) const
+    {
+        if (example_id >= header_->num_ids || !index_[example_id].example) {
+            return nullptr;
+        }
+        return GetExample(base_ + index_[example_id].example);
+    }
+
+    // nullptr if the id is not in the snapshot or its example has no comm feature
+    const CommFeature* comm_feat(uint32_t const example_id) const
+    {
+        if (example_id >= header_->num_ids || !index_[example_id].comm_feat) {
+            return nullptr;
+        }
+        return GetCommFeature(base_ + index_[example_id].comm_feat);
+    }
+
+  private:
+    Snapshot() = default;
+
+    const char* base_ = nullptr;
+    size_t size_ = 0;
+    SnapshotHeader const* header_ = nullptr;
+    SnapshotEntry const* index_ = nullptr;
+};
+}
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef __ALICCP_UNIQUE_H__
+#define __ALICCP_UNIQUE_H__
+
+#include "thread_pool.h"
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+namespace aliccp {
+
+size_t const kMaxUniqueShards = 64;
+size_t const kMinUniqueShard = 16384;
+
+// sorted unique values of ids[0, n) and the index of every id in them. shards are sorted and
+// deduplicated in parallel, merged once, then every shard maps its ids through its own small
+// unique list instead of searching the merged one.
+template<typename IdT>
+void
+unique_ids(IdT const* ids, size_t const n, std::vector<IdT>& unique, int32_t* inverse, ParallelFor const& parallel_for)
+{
+    unique.clear();
+    if (n == 0) {
+        return;
+    }
+
+    auto const nshards = std::max<size_t>(1, std::min(kMaxUniqueShards, n / kMinUniqueShard));
+    auto const block = (n + nshards - 1) / nshards;
+    // sort of a block, in approximate cpu cycles
+    auto const cost_per_unit = static_cast<int64_t>(block * 64);
+    std::vector<std::vector<IdT>> locals(nshards);
+
+    parallel_for(nshards, cost_per_unit, [&](int64_t start, int64_t end) {
+        for (auto s = start; s < end; ++s) {
+            auto& local = locals[s];
+            local.assign(ids + std::min(n, s * block), ids + std::min(n, (s + 1) * block));
+            std::sort(local.begin(), local.end());
+            local.erase(std::unique(local.begin(), local.end()), local.end());
+        }
+    });
+
+    using Head = std::pair<IdT, size_t>;
+    std::priority_queue<Head, std::vector<Head>, std::greater<Head>> heads;
+    std::vector<size_t> next(nshards, 1);
+    for (size_t s = 0; s < nshards; ++s) {
+        if (!locals[s].empty()) {
+            heads.emplace(locals[s][0], s);
+        }
+    }
+
+    while (!heads.empty()) {
+        auto const head = heads.top();
+        heads.pop();
+        if (unique.empty() || unique.back() != head.first) {
+            unique.push_back(head.first);
+        }
+
+        auto const& local = locals[head.second];
+        if (next[head.second] < local.size()) {
+            heads.emplace(local[next[head.second]++], head.second);
+        }
+    }
+
+    parallel_for(nshards, cost_per_unit, [&](int64_t start, int64_t end) {
+        std::vector<int32_t> to_unique;
+        for (auto s = start; s < end; ++s) {
+            auto const& local = locals[s];
+
+            // both lists are sorted, one walk finds every local id in the merged list
+            to_unique.resize(local.size());
+            size_t u = 0;
+            for (size_t j = 0; j < local.size(); ++j) {
+                while (unique[u] < local[j]) {
+                    ++u;
+                }
+                to_unique[j] = static_cast<int32_t>(u);
+            }
+
+            for (auto i = std::min(n, s * block); i < std::min(n, (s + 1) * block); ++i) {
+                auto const j = std::lower_bound(local.cbegin(), local.cend(), ids[i]) - local.cbegin();
+                inverse[i] = to_unique[j];
+            }
+        }
+    });
+}
+}
+
+#endif
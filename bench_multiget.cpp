@@ -0,0 +1,165 @@
+#include "Timer.h"
+#include "aliccp_key.h"
+#include "aliccp_reader.h"
+#include "aliccp_shard.h"
+#include <algorithm>
+#include <atomic>
+#include <gflags/gflags.h>
+#include <random>
+#include <rocksdb/db.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+struct BenchStat
+{
+    std::vector<float> latencies_us;
+    uint64_t keys = 0;
+    uint64_t errors = 0;
+};
+
+// batched MultiGet on the examples db the way Reader::read issues it: keys encoded in the db
+// format, sorted bytewise, values pinned
+static void
+run_reader(rocksdb::DB* db,
+           uint32_t const key_format,
+           std::vector<uint32_t> const& ids,
+           int const batch_size,
+           bool const sequential,
+           uint64_t const seed,
+           std::atomic<bool> const& stop,
+           BenchStat& stat)
+{
+    std::mt19937_64 rng(seed);
+    std::uniform_int_distribution<size_t> pick(0, ids.size() - 1);
+    std::vector<char> key_bytes(batch_size * aliccp::kExampleKeySize);
+    std::vector<rocksdb::Slice> keys(batch_size);
+    aliccp::PinnedValues values;
+    std::vector<rocksdb::Status> statuses(batch_size);
+    rocksdb::ReadOptions opt;
+
+    while (!stop) {
+        // sequential batches are consecutive ids of the sorted id list, as a key range scan yields
+        auto const first = pick(rng);
+        for (auto i = 0; i < batch_size; ++i) {
+            auto const id = sequential ? ids[(first + i) % ids.size()] : ids[pick(rng)];
+            aliccp::encode_example_key(id, key_format, &key_bytes[i * aliccp::kExampleKeySize]);
+            keys[i] = rocksdb::Slice(&key_bytes[i * aliccp::kExampleKeySize], aliccp::kExampleKeySize);
+        }
+        std::sort(keys.begin(), keys.end(), [](rocksdb::Slice const& a, rocksdb::Slice const& b) {
+            return a.compare(b) < 0;
+        });
+
+        // unpinning the previous batch is not part of the lookup
+        auto const pinned = values.reset(batch_size);
+        Timer timer;
+        db->MultiGet(opt, db->DefaultColumnFamily(), batch_size, keys.data(), pinned, statuses.data(), true);
+        stat.latencies_us.push_back(timer.elapsed_us());
+
+        for (auto const& s : statuses) {
+            stat.errors += s.ok() ? 0 : 1;
+        }
+        stat.keys += batch_size;
+    }
+}
+
+DEFINE_string(examples_db, "", "Path to examples db");
+DEFINE_string(db_profile, "default", "rocksdb options, default or point_lookup");
+DEFINE_string(db_options_file, "", "rocksdb OPTIONS file used instead of db_profile");
+DEFINE_int64(block_cache_mb, 1024, "block cache size");
+DEFINE_bool(direct_reads, false, "read sst files with O_DIRECT");
+DEFINE_int32(threads, 1, "concurrent readers");
+DEFINE_int32(batch, 1024, "keys per MultiGet");
+DEFINE_bool(sequential, false, "batches of consecutive ids instead of uniformly random ones");
+DEFINE_int32(seconds, 10, "benchmark duration");
+DEFINE_uint64(seed, 0, "seed of batch ids");
+
+int
+main(int argc, char* argv[])
+{
+    google::ParseCommandLineFlags(&argc, &argv, true);
+    if (FLAGS_examples_db.empty() || FLAGS_threads <= 0 || FLAGS_batch <= 0) {
+        fprintf(stderr, "examples_db is required, threads and batch must be positive\n");
+        return -1;
+    }
+
+    aliccp::DbProfile profile;
+    profile.options_file = FLAGS_db_options_file;
+    profile.block_cache_mb = FLAGS_block_cache_mb;
+    profile.direct_reads = FLAGS_direct_reads;
+    auto status = aliccp::parse_db_profile(FLAGS_db_profile, &profile.kind);
+    std::shared_ptr<rocksdb::DB> db;
+    if (status.ok()) {
+        status = aliccp::open_readonly_db(FLAGS_examples_db, profile, &db);
+    }
+    uint32_t key_format = aliccp::kKeyFormatLegacy;
+    if (status.ok()) {
+        status = aliccp::read_key_format(db.get(), &key_format);
+    }
+    if (!status.ok()) {
+        fprintf(stderr, "open db %s failed. what: %s\n", FLAGS_examples_db.c_str(), status.ToString().c_str());
+        return -1;
+    }
+
+    // the ids that exist, so every lookup finds its key
+    std::vector<uint32_t> ids;
+    status = aliccp::range_ids(db.get(), aliccp::KeyRange(), key_format, &ids);
+    if (!status.ok() || ids.empty()) {
+        fprintf(stderr, "scan ids failed: %s, %zu ids\n", status.ToString().c_str(), ids.size());
+        return -1;
+    }
+    std::sort(ids.begin(), ids.end());
+    fprintf(stderr, "%zu ids, key format %u, profile %s\n", ids.size(), key_format, FLAGS_db_profile.c_str());
+
+    std::atomic<bool> stop(false);
+    std::vector<BenchStat> stats(FLAGS_threads);
+    std::vector<std::thread> readers;
+    Timer timer;
+    for (auto i = 0; i < FLAGS_threads; ++i) {
+        readers.emplace_back(run_reader,
+                             db.get(),
+                             key_format,
+                             std::cref(ids),
+                             FLAGS_batch,
+                             FLAGS_sequential,
+                             FLAGS_seed + i,
+                             std::cref(stop),
+                             std::ref(stats[i]));
+    }
+
+    std::this_thread::sleep_for(std::chrono::seconds(FLAGS_seconds));
+    stop = true;
+    for (auto& t : readers) {
+        t.join();
+    }
+    auto const elapsed = timer.elapsed_sec();
+
+    BenchStat total;
+    for (auto const& stat : stats) {
+        total.latencies_us.insert(total.latencies_us.end(), stat.latencies_us.cbegin(), stat.latencies_us.cend());
+        total.keys += stat.keys;
+        total.errors += stat.errors;
+    }
+
+    auto& lat = total.latencies_us;
+    if (lat.empty()) {
+        fprintf(stderr, "no batch finished\n");
+        return -1;
+    }
+
+    std::sort(lat.begin(), lat.end());
+    auto percentile = [&lat](double const p) { return lat[std::min(lat.size() - 1, (size_t)(p * lat.size()))]; };
+    fprintf(stderr,
+            "batches = %zu, errors = %lu, batches/s = %.1f, keys/s = %.1f\n"
+            "latency us: p50 = %.1f, p90 = %.1f, p99 = %.1f, p999 = %.1f, max = %.1f\n",
+            lat.size(),
+            total.errors,
+            lat.size() / elapsed,
+            total.keys / elapsed,
+            percentile(0.5),
+            percentile(0.9),
+            percentile(0.99),
+            percentile(0.999),
+            lat.back());
+    return 0;
+}
@@ -0,0 +1,363 @@
+#include "aliccp_key.h"
+#include "aliccp_options.h"
+#include "example_generated.h"
+#include "label_index_generated.h"
+#include "lens_index_generated.h"
+#include <algorithm>
+#include <fstream>
+#include <gflags/gflags.h>
+#include <iterator>
+#include <map>
+#include <random>
+#include <rocksdb/db.h>
+#include <rocksdb/options.h>
+#include <rocksdb/table.h>
+
+// the destination is written with the sst layout of the profile it will be read with
+static rocksdb::Status
+open_db(const char* path, aliccp::DbProfile::Kind const profile, rocksdb::DB** db, bool const readonly)
+{
+    rocksdb::Options opt;
+    opt.create_if_missing = !readonly;
+    opt.max_open_files = 3000;
+    opt.write_buffer_size = 500 * 1024 * 1024;
+    opt.max_write_buffer_number = 3;
+    opt.target_file_size_base = 67108864;
+    opt.compression = rocksdb::kZlibCompression;
+
+    rocksdb::BlockBasedTableOptions table_opt;
+    aliccp::set_table_layout(profile, &table_opt);
+    table_opt.block_cache = rocksdb::NewLRUCache(1000 * (1024 * 1024));
+    table_opt.block_cache_compressed = rocksdb::NewLRUCache(500 * (1024 * 1024));
+    opt.table_factory.reset(rocksdb::NewBlockBasedTableFactory(table_opt));
+    if (readonly) {
+        return rocksdb::DB::OpenForReadOnly(opt, path, db);
+    }
+    return rocksdb::DB::Open(opt, path, db);
+}
+
+// group example ids by comm_feat_id, comm_feat_ids are visited in sorted order so the
+// permutation only depends on the db content and the seed
+static rocksdb::Status
+group_by_comm_feat(std::shared_ptr<rocksdb::DB> db,
+                   std::map<std::string, std::vector<uint32_t>>& groups,
+                   uint64_t* nexamples)
+{
+    rocksdb::ReadOptions opt;
+    opt.fill_cache = false;
+    std::unique_ptr<rocksdb::Iterator> it(db->NewIterator(opt));
+
+    uint64_t cnt = 0;
+    for (it->SeekToFirst(); it->Valid(); it->Next()) {
+        if (it->key().size() != aliccp::kExampleKeySize) {
+            continue;
+        }
+
+        auto example = aliccp::GetExample(it->value().data());
+        groups[example->comm_feat_id()->str()].push_back(example->example_id());
+        if (++cnt % 1000000 == 0) {
+            fprintf(stderr, "scan %lu examples, %zu comm feats\n", cnt, groups.size());
+        }
+    }
+
+    *nexamples = cnt;
+    return it->status();
+}
+
+// chunks keep examples of the same comm feat next to each other, shuffling whole chunks
+// keeps batches from being dominated by one user
+static std::vector<uint32_t>
+make_permutation(std::map<std::string, std::vector<uint32_t>>& groups,
+                 uint64_t const nexamples,
+                 uint32_t const chunk_size,
+                 uint64_t const seed)
+{
+    std::mt19937_64 engine(seed);
+
+    std::vector<uint32_t> clustered;
+    clustered.reserve(nexamples);
+    for (auto& group : groups) {
+        std::shuffle(group.second.begin(), group.second.end(), engine);
+        clustered.insert(clustered.end(), group.second.cbegin(), group.second.cend());
+        std::vector<uint32_t>().swap(group.second);
+    }
+
+    std::vector<uint64_t> chunks;
+    for (uint64_t start = 0; start < clustered.size(); start += chunk_size) {
+        chunks.push_back(start);
+    }
+    std::shuffle(chunks.begin(), chunks.end(), engine);
+
+    std::vector<uint32_t> permutation;
+    permutation.reserve(clustered.size());
+    for (auto const start : chunks) {
+        auto const end = std::min(start + chunk_size, (uint64_t)clustered.size());
+        permutation.insert(permutation.end(), clustered.cbegin() + start, clustered.cbegin() + end);
+    }
+
+    return permutation;
+}
+
+// rewrite examples keyed by their position in the permutation, a batch of consecutive
+// positions then shares its comm feats and its sst blocks. positions are written as big endian
+// keys whatever the format of the source db.
+static int
+rewrite_examples(std::shared_ptr<rocksdb::DB> src,
+                 uint32_t const src_key_format,
+                 std::string const& path_to_db,
+                 aliccp::DbProfile::Kind const profile,
+                 std::vector<uint32_t> const& permutation,
+                 int const batch_size)
+{
+    rocksdb::DB* db = nullptr;
+    auto status = open_db(path_to_db.c_str(), profile, &db, false);
+    if (!status.ok()) {
+        fprintf(stderr, "open db failed: %s, msg: %s\n", path_to_db.c_str(), status.ToString().c_str());
+        return -1;
+    }
+    auto dst = std::shared_ptr<rocksdb::DB>(db);
+    status = aliccp::write_key_format(dst.get(), aliccp::kKeyFormatBigEndian);
+    if (!status.ok()) {
+        fprintf(stderr, "write key format to %s failed: %s\n", path_to_db.c_str(), status.ToString().c_str());
+        return -1;
+    }
+
+    rocksdb::ReadOptions read_opt;
+    read_opt.fill_cache = false;
+    rocksdb::WriteOptions write_opt;
+    write_opt.disableWAL = true;
+
+    for (uint64_t start = 0; start < permutation.size(); start += batch_size) {
+        auto const end = std::min(start + batch_size, (uint64_t)permutation.size());
+        std::vector<char> key_bytes((end - start) * aliccp::kExampleKeySize);
+        std::vector<rocksdb::Slice> keys;
+        for (auto i = start; i < end; ++i) {
+            auto const key = &key_bytes[(i - start) * aliccp::kExampleKeySize];
+            aliccp::encode_example_key(permutation[i], src_key_format, key);
+            keys.emplace_back(key, aliccp::kExampleKeySize);
+        }
+
+        std::vector<std::string> values;
+        auto statuses = src->MultiGet(read_opt, keys, &values);
+
+        rocksdb::WriteBatch batch;
+        for (auto i = start; i < end; ++i) {
+            auto const& s = statuses[i - start];
+            if (!s.ok()) {
+                fprintf(stderr, "read example %u failed: %s\n", permutation[i], s.ToString().c_str());
+                return -1;
+            }
+
+            char key[aliccp::kExampleKeySize];
+            aliccp::encode_example_key(static_cast<uint32_t>(i), aliccp::kKeyFormatBigEndian, key);
+            batch.Put(rocksdb::Slice(key, sizeof(key)), values[i - start]);
+        }
+
+        status = dst->Write(write_opt, &batch);
+        if (!status.ok()) {
+            fprintf(stderr, "write %s failed: %s\n", path_to_db.c_str(), status.ToString().c_str());
+            return -1;
+        }
+        fprintf(stderr, "rewrite %lu/%zu examples\n", end, permutation.size());
+    }
+
+    status = dst->Flush(rocksdb::FlushOptions());
+    if (status.ok()) {
+        status = dst->CompactRange(rocksdb::CompactRangeOptions(), nullptr, nullptr);
+    }
+    if (!status.ok()) {
+        fprintf(stderr, "compact %s failed: %s\n", path_to_db.c_str(), status.ToString().c_str());
+        return -1;
+    }
+
+    return 0;
+}
+
+static bool
+read_file(std::string const& path, std::vector<char>& buffer)
+{
+    std::ifstream ifs(path, std::ios::binary);
+    if (!ifs) {
+        fprintf(stderr, "open %s failed\n", path.c_str());
+        return false;
+    }
+    buffer.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+    return true;
+}
+
+static bool
+write_file(std::string const& path, flatbuffers::FlatBufferBuilder const& builder)
+{
+    std::ofstream ofile(path, std::ios::binary);
+    ofile.write(reinterpret_cast<const char*>(builder.GetBufferPointer()), builder.GetSize());
+    ofile.close();
+    if (!ofile) {
+        fprintf(stderr, "write %s failed\n", path.c_str());
+        return false;
+    }
+    return true;
+}
+
+// the lens index of output_db is keyed by permutation position like its examples, ids missing
+// from the source index stay missing
+static bool
+remap_lens_index(std::string const& src_path, std::string const& dst_path, std::vector<uint32_t> const& permutation)
+{
+    std::vector<char> buffer;
+    if (!read_file(src_path, buffer)) {
+        return false;
+    }
+    auto const index = aliccp::GetLenIndex(buffer.data());
+    if (!index || !index->entries()) {
+        fprintf(stderr, "read lens index %s failed: index has not entries\n", src_path.c_str());
+        return false;
+    }
+
+    // struct vectors are stored inline, Data() is the first LenEntry
+    auto const begin = reinterpret_cast<aliccp::LenEntry const*>(index->entries()->Data());
+    auto const end = begin + index->entries()->size();
+    std::vector<aliccp::LenEntry> entries;
+    entries.reserve(permutation.size());
+    for (size_t i = 0; i < permutation.size(); ++i) {
+        auto it = std::lower_bound(begin, end, permutation[i], [](aliccp::LenEntry const& entry, uint32_t const id) {
+            return entry.example_id() < id;
+        });
+        if (it != end && it->example_id() == permutation[i]) {
+            entries.emplace_back(static_cast<uint32_t>(i), it->len());
+        }
+    }
+
+    flatbuffers::FlatBufferBuilder builder(0);
+    builder.Finish(aliccp::CreateLenIndexDirect(builder, &entries));
+    return write_file(dst_path, builder);
+}
+
+static bool
+test_bit(flatbuffers::Vector<uint8_t> const* bitmap, uint32_t const i)
+{
+    return i / 8 < bitmap->size() && ((bitmap->Get(i / 8) >> (i % 8)) & 1);
+}
+
+static void
+set_bit(std::vector<uint8_t>& bitmap, uint32_t const i, bool const on)
+{
+    if (on) {
+        bitmap[i / 8] |= static_cast<uint8_t>(1u << (i % 8));
+    }
+}
+
+// bit i of the remapped bitmaps belongs to position i of the permutation
+static bool
+remap_label_index(std::string const& src_path, std::string const& dst_path, std::vector<uint32_t> const& permutation)
+{
+    std::vector<char> buffer;
+    if (!read_file(src_path, buffer)) {
+        return false;
+    }
+    auto const index = aliccp::GetLabelIndex(buffer.data());
+    if (!index || !index->exists() || !index->y() || !index->z()) {
+        fprintf(stderr, "read label index %s failed: index has not bitmaps\n", src_path.c_str());
+        return false;
+    }
+
+    auto const nbytes = (permutation.size() + 7) / 8;
+    std::vector<uint8_t> exists(nbytes, 0), y(nbytes, 0), z(nbytes, 0);
+    for (size_t i = 0; i < permutation.size(); ++i) {
+        auto const id = permutation[i];
+        auto const pos = static_cast<uint32_t>(i);
+        set_bit(exists, pos, test_bit(index->exists(), id));
+        set_bit(y, pos, test_bit(index->y(), id));
+        set_bit(z, pos, test_bit(index->z(), id));
+    }
+
+    flatbuffers::FlatBufferBuilder builder(0);
+    builder.Finish(aliccp::CreateLabelIndexDirect(builder, &exists, &y, &z));
+    return write_file(dst_path, builder);
+}
+
+DEFINE_string(examples_db, "", "Path to examples db");
+DEFINE_string(permutation, "", "Path to output permutation, a flat little-endian uint32 array of example ids");
+DEFINE_string(output_db, "", "Path to examples db rewritten in permutation order, optional");
+DEFINE_int32(chunk_size, 4096, "examples per locality-preserving chunk");
+DEFINE_int32(batch, 10000, "batch size of rewrite");
+DEFINE_uint64(seed, 0, "seed of in-group and cross-chunk shuffles");
+DEFINE_string(lens_index, "", "lens index of examples_db written by write_to_db, remapped for output_db, optional");
+DEFINE_string(output_lens_index, "", "Path to lens index of output_db keyed by permutation position");
+DEFINE_string(label_index, "", "label index of examples_db written by write_to_db, remapped for output_db, optional");
+DEFINE_string(output_label_index, "", "Path to label index of output_db keyed by permutation position");
+DEFINE_string(db_profile, "default", "sst layout of output_db, default or point_lookup, read it with the same profile");
+
+int
+main(int argc, char* argv[])
+{
+    google::ParseCommandLineFlags(&argc, &argv, true);
+    if (FLAGS_examples_db.empty() || FLAGS_permutation.empty() || FLAGS_chunk_size <= 0) {
+        fprintf(stderr, "examples_db, permutation, chunk_size > 0 are required\n");
+        return -1;
+    }
+    // side indexes are keyed like the db, they only need remapping for a position keyed output_db
+    if (FLAGS_lens_index.empty() != FLAGS_output_lens_index.empty() ||
+        FLAGS_label_index.empty() != FLAGS_output_label_index.empty() ||
+        (FLAGS_output_db.empty() && !(FLAGS_lens_index.empty() && FLAGS_label_index.empty()))) {
+        fprintf(stderr, "lens_index and label_index need output_db and their output_ paths\n");
+        return -1;
+    }
+
+    aliccp::DbProfile::Kind profile;
+    auto status = aliccp::parse_db_profile(FLAGS_db_profile, &profile);
+    if (!status.ok()) {
+        fprintf(stderr, "%s\n", status.ToString().c_str());
+        return -1;
+    }
+
+    rocksdb::DB* p;
+    status = open_db(FLAGS_examples_db.c_str(), profile, &p, true);
+    if (!status.ok()) {
+        fprintf(stderr, "open db %s failed. what: %s\n", FLAGS_examples_db.c_str(), status.ToString().c_str());
+        return -1;
+    }
+    auto db = std::shared_ptr<rocksdb::DB>(p);
+
+    uint32_t key_format;
+    status = aliccp::read_key_format(db.get(), &key_format);
+    if (!status.ok()) {
+        fprintf(stderr, "read key format of %s failed: %s\n", FLAGS_examples_db.c_str(), status.ToString().c_str());
+        return -1;
+    }
+
+    std::map<std::string, std::vector<uint32_t>> groups;
+    uint64_t nexamples = 0;
+    status = group_by_comm_feat(db, groups, &nexamples);
+    if (!status.ok()) {
+        fprintf(stderr,
+                "scan %s failed after %lu examples: %s\n",
+                FLAGS_examples_db.c_str(),
+                nexamples,
+                status.ToString().c_str());
+        return -1;
+    }
+    fprintf(stderr, "%lu examples in %zu comm feat groups\n", nexamples, groups.size());
+
+    auto const permutation = make_permutation(groups, nexamples, FLAGS_chunk_size, FLAGS_seed);
+
+    std::ofstream ofile(FLAGS_permutation, std::ios::binary);
+    ofile.write(reinterpret_cast<const char*>(permutation.data()), permutation.size() * sizeof(uint32_t));
+    ofile.close();
+    if (!ofile) {
+        fprintf(stderr, "write permutation %s failed\n", FLAGS_permutation.c_str());
+        return -1;
+    }
+
+    if (!FLAGS_lens_index.empty() && !remap_lens_index(FLAGS_lens_index, FLAGS_output_lens_index, permutation)) {
+        return -1;
+    }
+    if (!FLAGS_label_index.empty() && !remap_label_index(FLAGS_label_index, FLAGS_output_label_index, permutation)) {
+        return -1;
+    }
+
+    if (!FLAGS_output_db.empty()) {
+        return rewrite_examples(db, key_format, FLAGS_output_db, profile, permutation, FLAGS_batch);
+    }
+
+    return 0;
+}
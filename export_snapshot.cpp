@@ -0,0 +1,226 @@
+#include "aliccp_key.h"
+#include "aliccp_snapshot.h"
+#include "comm_feats_generated.h"
+#include "example_generated.h"
+#include <fstream>
+#include <gflags/gflags.h>
+#include <rocksdb/db.h>
+#include <rocksdb/options.h>
+#include <rocksdb/table.h>
+#include <string.h>
+#include <unordered_map>
+#include <vector>
+
+static rocksdb::Status
+open_db(const char* path, rocksdb::DB** db)
+{
+    rocksdb::Options opt;
+    opt.create_if_missing = false;
+    opt.max_open_files = 3000;
+    opt.compression = rocksdb::kZlibCompression;
+
+    rocksdb::BlockBasedTableOptions table_opt;
+    table_opt.block_cache = rocksdb::NewLRUCache(100 * (1024 * 1024));
+    opt.table_factory.reset(rocksdb::NewBlockBasedTableFactory(table_opt));
+    return rocksdb::DB::OpenForReadOnly(opt, path, db);
+}
+
+// appends flatbuffers at aligned offsets, offset 0 is taken by the header so it can mean missing
+class SnapshotWriter
+{
+  public:
+    explicit SnapshotWriter(std::string const& path)
+        : ofs_(path, std::ios::binary | std::ios::trunc)
+    {
+        aliccp::SnapshotHeader header;
+        memset(&header, 0, sizeof(header));
+        write(&header, sizeof(header));
+    }
+
+    bool good() const { return ofs_.good(); }
+
+    uint64_t append(rocksdb::Slice const& value)
+    {
+        align();
+        auto const offset = offset_;
+        write(value.data(), value.size());
+        return offset;
+    }
+
+    // index goes after the data, the header is rewritten once its offset is known
+    bool finish(aliccp::SnapshotHeader header, std::vector<aliccp::SnapshotEntry> const& index)
+    {
+        align();
+        header.index_offset = offset_;
+        header.num_ids = index.size();
+        write(index.data(), index.size() * sizeof(aliccp::SnapshotEntry));
+
+        ofs_.seekp(0);
+        ofs_.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        ofs_.close();
+        return !ofs_.fail();
+    }
+
+  private:
+    void align()
+    {
+        static char const zeros[aliccp::kSnapshotAlign] = { 0 };
+        auto const pad = (aliccp::kSnapshotAlign - offset_ % aliccp::kSnapshotAlign) % aliccp::kSnapshotAlign;
+        write(zeros, pad);
+    }
+
+    void write(const void* data, size_t const size)
+    {
+        ofs_.write(static_cast<const char*>(data), size);
+        offset_ += size;
+    }
+
+    std::ofstream ofs_;
+    uint64_t offset_ = 0;
+};
+
+static bool
+export_comm_feats(rocksdb::DB* db, SnapshotWriter& writer, std::unordered_map<std::string, uint64_t>& offsets)
+{
+    rocksdb::ReadOptions opt;
+    opt.fill_cache = false;
+    std::unique_ptr<rocksdb::Iterator> it(db->NewIterator(opt));
+
+    for (it->SeekToFirst(); it->Valid(); it->Next()) {
+        offsets[it->key().ToString()] = writer.append(it->value());
+        if (offsets.size() % 100000 == 0) {
+            fprintf(stderr, "export %zu comm feats\n", offsets.size());
+        }
+    }
+
+    if (!it->status().ok()) {
+        fprintf(stderr, "scan comm feats db failed: %s\n", it->status().ToString().c_str());
+        return false;
+    }
+    return true;
+}
+
+// examples are indexed by their db key, the same id the op looks up. without a comm feats db
+// every example has to be prejoined.
+static bool
+export_examples(rocksdb::DB* db,
+                uint32_t const key_format,
+                bool const has_comm_feats,
+                SnapshotWriter& writer,
+                std::unordered_map<std::string, uint64_t> const& comm_offsets,
+                std::vector<aliccp::SnapshotEntry>& index,
+                uint64_t& nexamples)
+{
+    rocksdb::ReadOptions opt;
+    opt.fill_cache = false;
+    std::unique_ptr<rocksdb::Iterator> it(db->NewIterator(opt));
+
+    for (it->SeekToFirst(); it->Valid(); it->Next()) {
+        if (it->key().size() != aliccp::kExampleKeySize) {
+            continue;
+        }
+
+        auto const example_id = aliccp::decode_example_key(it->key().data(), key_format);
+        if (example_id >= index.size()) {
+            index.resize(static_cast<size_t>(example_id) + 1, aliccp::SnapshotEntry{ 0, 0 });
+        }
+
+        // prejoined examples already hold their comm feats, the others must find theirs
+        auto const example = aliccp::GetExample(it->value().data());
+        index[example_id].comm_feat = 0;
+        if (!example->joined()) {
+            if (!has_comm_feats) {
+                fprintf(stderr, "examples are not prejoined and no comm_feats_db is given\n");
+                return false;
+            }
+            auto const comm_it = comm_offsets.find(example->comm_feat_id()->str());
+            if (comm_it == comm_offsets.cend()) {
+                fprintf(stderr,
+                        "comm feat %s of example %u not found in comm feats db\n",
+                        example->comm_feat_id()->c_str(),
+                        example_id);
+                return false;
+            }
+            index[example_id].comm_feat = comm_it->second;
+        }
+        index[example_id].example = writer.append(it->value());
+
+        if (++nexamples % 1000000 == 0) {
+            fprintf(stderr, "export %lu examples\n", nexamples);
+        }
+    }
+
+    if (!it->status().ok()) {
+        fprintf(stderr, "scan examples db failed: %s\n", it->status().ToString().c_str());
+        return false;
+    }
+    return true;
+}
+
+DEFINE_string(examples_db, "", "Path to examples db");
+DEFINE_string(comm_feats_db, "", "Path to comm feats db, not needed for examples written with -prejoin");
+DEFINE_string(snapshot, "", "Path to output snapshot");
+
+int
+main(int argc, char* argv[])
+{
+    google::ParseCommandLineFlags(&argc, &argv, true);
+    if (FLAGS_examples_db.empty() || FLAGS_snapshot.empty()) {
+        fprintf(stderr, "examples_db, snapshot are required\n");
+        return -1;
+    }
+
+    rocksdb::DB* db = nullptr;
+    auto status = open_db(FLAGS_examples_db.c_str(), &db);
+    if (!status.ok()) {
+        fprintf(stderr, "open db failed: %s, msg: %s\n", FLAGS_examples_db.c_str(), status.ToString().c_str());
+        return -1;
+    }
+    std::shared_ptr<rocksdb::DB> examples_db(db);
+
+    uint32_t key_format;
+    status = aliccp::read_key_format(examples_db.get(), &key_format);
+    if (!status.ok()) {
+        fprintf(stderr, "read key format of %s failed: %s\n", FLAGS_examples_db.c_str(), status.ToString().c_str());
+        return -1;
+    }
+
+    std::shared_ptr<rocksdb::DB> comm_feats_db;
+    if (!FLAGS_comm_feats_db.empty()) {
+        status = open_db(FLAGS_comm_feats_db.c_str(), &db);
+        if (!status.ok()) {
+            fprintf(stderr, "open db failed: %s, msg: %s\n", FLAGS_comm_feats_db.c_str(), status.ToString().c_str());
+            return -1;
+        }
+        comm_feats_db.reset(db);
+    }
+
+    SnapshotWriter writer(FLAGS_snapshot);
+    if (!writer.good()) {
+        fprintf(stderr, "open %s failed\n", FLAGS_snapshot.c_str());
+        return -1;
+    }
+
+    std::unordered_map<std::string, uint64_t> comm_offsets;
+    std::vector<aliccp::SnapshotEntry> index;
+    uint64_t nexamples = 0;
+    if ((comm_feats_db && !export_comm_feats(comm_feats_db.get(), writer, comm_offsets)) ||
+        !export_examples(
+          examples_db.get(), key_format, comm_feats_db != nullptr, writer, comm_offsets, index, nexamples)) {
+        return -1;
+    }
+
+    aliccp::SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = aliccp::kSnapshotMagic;
+    header.version = aliccp::kSnapshotVersion;
+    header.num_examples = nexamples;
+    header.num_comm_feats = comm_offsets.size();
+    if (!writer.finish(header, index)) {
+        fprintf(stderr, "write %s failed\n", FLAGS_snapshot.c_str());
+        return -1;
+    }
+
+    fprintf(stderr, "export %lu examples, %zu comm feats, %zu ids\n", nexamples, comm_offsets.size(), index.size());
+    return 0;
+}
@@ -0,0 +1,173 @@
+#include "Timer.h"
+#include "feature_server_proto.h"
+#include <algorithm>
+#include <atomic>
+#include <gflags/gflags.h>
+#include <random>
+#include <string.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <vector>
+
+static int
+connect_server(std::string const& path)
+{
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+    auto fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+        ::close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// payload following a response header
+static size_t
+response_size(aliccp::ResponseHeader const& header)
+{
+    if (header.status != 0) {
+        return header.nfeats;
+    }
+
+    return header.n * sizeof(uint32_t) + header.nfeats * (2 * sizeof(uint32_t) + sizeof(float)) +
+           header.n * 2 * sizeof(uint8_t);
+}
+
+struct ClientStat
+{
+    std::vector<float> latencies_us;
+    uint64_t examples = 0;
+    uint64_t feats = 0;
+    uint64_t errors = 0;
+};
+
+static void
+run_client(std::string const& path,
+           uint32_t const batch,
+           uint32_t const max_id,
+           uint64_t const seed,
+           std::atomic<bool> const& stop,
+           ClientStat& stat)
+{
+    auto fd = connect_server(path);
+    if (fd < 0) {
+        fprintf(stderr, "connect %s failed: %s\n", path.c_str(), strerror(errno));
+        ++stat.errors;
+        return;
+    }
+
+    std::mt19937_64 engine(seed);
+    std::uniform_int_distribution<uint32_t> dist(1, max_id);
+    std::vector<uint32_t> ids(batch);
+    std::vector<char> payload;
+
+    while (!stop.load(std::memory_order_relaxed)) {
+        std::generate(ids.begin(), ids.end(), [&] { return dist(engine); });
+
+        Timer timer;
+        aliccp::RequestHeader request{ aliccp::kRequestMagic, batch };
+        aliccp::ResponseHeader response;
+        if (!aliccp::write_all(fd, &request, sizeof(request)) ||
+            !aliccp::write_all(fd, ids.data(), ids.size() * sizeof(uint32_t)) ||
+            !aliccp::read_all(fd, &response, sizeof(response))) {
+            ++stat.errors;
+            break;
+        }
+
+        payload.resize(response_size(response));
+        if (!aliccp::read_all(fd, payload.data(), payload.size())) {
+            ++stat.errors;
+            break;
+        }
+        stat.latencies_us.push_back(timer.elapsed_us());
+
+        if (response.magic != aliccp::kResponseMagic || response.status != 0) {
+            ++stat.errors;
+            continue;
+        }
+        stat.examples += response.n;
+        stat.feats += response.nfeats;
+    }
+
+    ::close(fd);
+}
+
+DEFINE_string(socket, "/tmp/aliccp_feature_server.sock", "Path to unix domain socket of feature_server");
+DEFINE_int32(connections, 16, "concurrent client connections");
+DEFINE_int32(batch, 64, "example ids per request");
+DEFINE_int32(max_id, 1000000, "request ids are drawn uniformly from [1, max_id]");
+DEFINE_int32(seconds, 10, "benchmark duration");
+DEFINE_uint64(seed, 0, "seed of request ids");
+
+int
+main(int argc, char* argv[])
+{
+    google::ParseCommandLineFlags(&argc, &argv, true);
+    if (FLAGS_connections <= 0 || FLAGS_batch <= 0 || FLAGS_max_id <= 0) {
+        fprintf(stderr, "connections, batch, max_id must be positive\n");
+        return -1;
+    }
+
+    std::atomic<bool> stop(false);
+    std::vector<ClientStat> stats(FLAGS_connections);
+    std::vector<std::thread> clients;
+    Timer timer;
+    for (auto i = 0; i < FLAGS_connections; ++i) {
+        clients.emplace_back(run_client,
+                             FLAGS_socket,
+                             FLAGS_batch,
+                             FLAGS_max_id,
+                             FLAGS_seed + i,
+                             std::cref(stop),
+                             std::ref(stats[i]));
+    }
+
+    std::this_thread::sleep_for(std::chrono::seconds(FLAGS_seconds));
+    stop = true;
+    for (auto& t : clients) {
+        t.join();
+    }
+    auto const elapsed = timer.elapsed_sec();
+
+    ClientStat total;
+    for (auto const& stat : stats) {
+        total.latencies_us.insert(total.latencies_us.end(), stat.latencies_us.cbegin(), stat.latencies_us.cend());
+        total.examples += stat.examples;
+        total.feats += stat.feats;
+        total.errors += stat.errors;
+    }
+
+    auto& lat = total.latencies_us;
+    if (lat.empty()) {
+        fprintf(stderr, "no request finished, errors = %lu\n", total.errors);
+        return -1;
+    }
+
+    std::sort(lat.begin(), lat.end());
+    auto percentile = [&lat](double const p) { return lat[std::min(lat.size() - 1, (size_t)(p * lat.size()))]; };
+    fprintf(stderr,
+            "requests = %zu, errors = %lu, qps = %.1f, examples/s = %.1f, feats/s = %.1f\n"
+            "latency us: p50 = %.1f, p90 = %.1f, p99 = %.1f, p999 = %.1f, max = %.1f\n",
+            lat.size(),
+            total.errors,
+            lat.size() / elapsed,
+            total.examples / elapsed,
+            total.feats / elapsed,
+            percentile(0.5),
+            percentile(0.9),
+            percentile(0.99),
+            percentile(0.999),
+            lat.back());
+    return 0;
+}
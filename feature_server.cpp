@@ -0,0 +1,332 @@
+#include "aliccp_reader.h"
+#include "feature_server_proto.h"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <gflags/gflags.h>
+#include <mutex>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+
+// one MultiGet result shared by all the requests merged into it
+struct MergedRead
+{
+    rocksdb::Status status;
+    aliccp::Batch batch;
+};
+
+// where the examples of one request live inside a MergedRead
+struct ReadSlot
+{
+    std::shared_ptr<MergedRead> read;
+    size_t offset;
+};
+
+struct PendingRequest
+{
+    std::vector<uint32_t> ids;
+    std::chrono::steady_clock::time_point arrival;
+    std::promise<ReadSlot> slot;
+};
+
+// merges concurrent requests into one MultiGet, a merged batch is issued once it holds
+// max_batch ids or its oldest request has waited max_wait_us
+class MicroBatcher
+{
+  public:
+    MicroBatcher(aliccp::Reader const& reader,
+                 size_t const max_batch,
+                 int64_t const max_wait_us,
+                 int const threads)
+        : reader_(reader)
+        , max_batch_(max_batch)
+        , max_wait_(max_wait_us)
+    {
+        for (auto i = 0; i < threads; ++i) {
+            threads_.emplace_back(&MicroBatcher::run, this);
+        }
+    }
+
+    ~MicroBatcher()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        cond_.notify_all();
+        for (auto& t : threads_) {
+            t.join();
+        }
+    }
+
+    std::future<ReadSlot> submit(std::vector<uint32_t> ids)
+    {
+        std::shared_ptr<PendingRequest> request(new PendingRequest);
+        request->ids = std::move(ids);
+        request->arrival = std::chrono::steady_clock::now();
+        auto future = request->slot.get_future();
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            queued_ids_ += request->ids.size();
+            queue_.push_back(std::move(request));
+        }
+        cond_.notify_one();
+        return future;
+    }
+
+  private:
+    void run()
+    {
+        while (true) {
+            std::vector<std::shared_ptr<PendingRequest>> requests;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cond_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+                if (queue_.empty()) {
+                    return;
+                }
+
+                auto const deadline = queue_.front()->arrival + max_wait_;
+                cond_.wait_until(lock, deadline, [this] { return stop_ || queued_ids_ >= max_batch_; });
+
+                size_t nids = 0;
+                while (!queue_.empty() && (requests.empty() || nids + queue_.front()->ids.size() <= max_batch_)) {
+                    nids += queue_.front()->ids.size();
+                    requests.push_back(std::move(queue_.front()));
+                    queue_.pop_front();
+                }
+                queued_ids_ -= nids;
+            }
+
+            process(requests);
+        }
+    }
+
+    void process(std::vector<std::shared_ptr<PendingRequest>>& requests)
+    {
+        std::vector<uint32_t> ids;
+        for (auto const& request : requests) {
+            ids.insert(ids.end(), request->ids.cbegin(), request->ids.cend());
+        }
+
+        std::shared_ptr<MergedRead> read(new MergedRead);
+        read->status = reader_.read(ids.data(), ids.size(), read->batch);
+        if (read->status.ok() || requests.size() == 1) {
+            size_t offset = 0;
+            for (auto& request : requests) {
+                request->slot.set_value(ReadSlot{ read, offset });
+                offset += request->ids.size();
+            }
+            return;
+        }
+
+        // one missing example must not fail the other requests merged with it
+        for (auto& request : requests) {
+            std::shared_ptr<MergedRead> single(new MergedRead);
+            single->status = reader_.read(request->ids.data(), request->ids.size(), single->batch);
+            request->slot.set_value(ReadSlot{ single, 0 });
+        }
+    }
+
+    aliccp::Reader const& reader_;
+    size_t const max_batch_;
+    std::chrono::microseconds const max_wait_;
+
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::deque<std::shared_ptr<PendingRequest>> queue_;
+    size_t queued_ids_ = 0;
+    bool stop_ = false;
+    std::vector<std::thread> threads_;
+};
+
+template<typename T>
+static void
+append(std::vector<char>& out, std::vector<T> const& values)
+{
+    auto p = reinterpret_cast<char const*>(values.data());
+    out.insert(out.end(), p, p + values.size() * sizeof(T));
+}
+
+static void
+serialize_response(aliccp::Reader const& reader,
+                   ReadSlot const& slot,
+                   uint32_t const n,
+                   uint32_t const max_feats,
+                   std::vector<char>& out)
+{
+    aliccp::ResponseHeader header{ aliccp::kResponseMagic, 0, n, 0 };
+    out.clear();
+
+    if (!slot.read->status.ok()) {
+        auto const msg = slot.read->status.ToString();
+        header.status = -1;
+        header.nfeats = static_cast<uint32_t>(msg.size());
+        out.insert(out.end(), reinterpret_cast<char const*>(&header), reinterpret_cast<char const*>(&header + 1));
+        out.insert(out.end(), msg.cbegin(), msg.cend());
+        return;
+    }
+
+    std::vector<uint32_t> lens;
+    std::vector<uint32_t> field_ids;
+    std::vector<uint32_t> feat_ids;
+    std::vector<float> values;
+    std::vector<uint8_t> y;
+    std::vector<uint8_t> z;
+
+    // example features first, then comm features, truncated to max_feats like the op
+    auto append_feats = [&](flatbuffers::Vector<flatbuffers::Offset<aliccp::Feature>> const* feats,
+                            size_t const start) {
+        for (auto const& feat : *feats) {
+            if (field_ids.size() - start >= max_feats) {
+                return;
+            }
+            field_ids.push_back(feat->feat_field_id());
+            feat_ids.push_back(static_cast<uint32_t>(reader.vocab_id(feat->feat_field_id(), feat->feat_id())));
+            values.push_back(feat->value());
+        }
+    };
+
+    auto const& batch = slot.read->batch;
+    for (auto i = slot.offset; i < slot.offset + n; ++i) {
+        auto const example = batch.examples[i];
+        auto const start = field_ids.size();
+        append_feats(example->feats(), start);
+        if (batch.comm_feats[i]) {
+            append_feats(batch.comm_feats[i]->feats(), start);
+        }
+
+        lens.push_back(static_cast<uint32_t>(field_ids.size() - start));
+        y.push_back(example->y());
+        z.push_back(example->z());
+    }
+    header.nfeats = static_cast<uint32_t>(field_ids.size());
+
+    out.insert(out.end(), reinterpret_cast<char const*>(&header), reinterpret_cast<char const*>(&header + 1));
+    append(out, lens);
+    append(out, field_ids);
+    append(out, feat_ids);
+    append(out, values);
+    append(out, y);
+    append(out, z);
+}
+
+static void
+serve(int const fd,
+      aliccp::Reader const& reader,
+      MicroBatcher& batcher,
+      uint32_t const max_feats,
+      uint32_t const max_ids)
+{
+    std::vector<char> out;
+    while (true) {
+        aliccp::RequestHeader header;
+        if (!aliccp::read_all(fd, &header, sizeof(header))) {
+            break;
+        }
+
+        if (header.magic != aliccp::kRequestMagic || header.n > max_ids) {
+            fprintf(stderr, "bad request: magic = 0x%x, n = %u\n", header.magic, header.n);
+            break;
+        }
+
+        std::vector<uint32_t> ids(header.n);
+        if (!aliccp::read_all(fd, ids.data(), ids.size() * sizeof(uint32_t))) {
+            break;
+        }
+
+        auto slot = batcher.submit(std::move(ids)).get();
+        serialize_response(reader, slot, header.n, max_feats, out);
+        if (!aliccp::write_all(fd, out.data(), out.size())) {
+            break;
+        }
+    }
+
+    ::close(fd);
+}
+
+DEFINE_string(socket, "/tmp/aliccp_feature_server.sock", "Path to unix domain socket");
+DEFINE_string(examples_db, "", "Path to examples db");
+DEFINE_string(comm_feats_db, "", "Path to comm feats db, not needed for examples written with -prejoin");
+DEFINE_string(vocab, "", "Path to vocab flatbuffers binary");
+DEFINE_string(snapshot, "", "Path to snapshot written by export_snapshot, replaces examples_db and comm_feats_db");
+DEFINE_bool(snapshot_populate, false, "fault the whole snapshot into memory at startup");
+DEFINE_string(db_profile, "default", "rocksdb options of the dbs, default or point_lookup");
+DEFINE_string(db_options_file, "", "rocksdb OPTIONS file used instead of db_profile");
+DEFINE_int64(block_cache_mb, 1024, "block cache of each db");
+DEFINE_bool(direct_reads, false, "read sst files with O_DIRECT");
+DEFINE_int32(max_feats, 1000, "features per example are truncated to max_feats");
+DEFINE_int32(max_batch, 4096, "max example ids merged into one MultiGet");
+DEFINE_int64(max_wait_us, 200, "max microseconds a request waits to be merged");
+DEFINE_int32(batch_threads, 2, "threads issuing merged MultiGets");
+DEFINE_int32(max_request, 65536, "max example ids of one request");
+
+int
+main(int argc, char* argv[])
+{
+    google::ParseCommandLineFlags(&argc, &argv, true);
+    if ((FLAGS_snapshot.empty() && FLAGS_examples_db.empty()) || FLAGS_vocab.empty()) {
+        fprintf(stderr, "vocab and either snapshot or examples_db are required\n");
+        return -1;
+    }
+
+    std::unique_ptr<aliccp::Reader> reader;
+    rocksdb::Status status;
+    if (FLAGS_snapshot.empty()) {
+        aliccp::DbProfile profile;
+        profile.options_file = FLAGS_db_options_file;
+        profile.block_cache_mb = FLAGS_block_cache_mb;
+        profile.direct_reads = FLAGS_direct_reads;
+        status = aliccp::parse_db_profile(FLAGS_db_profile, &profile.kind);
+        if (status.ok()) {
+            status = aliccp::Reader::open(FLAGS_examples_db, FLAGS_comm_feats_db, FLAGS_vocab, 1, profile, &reader);
+        }
+    } else {
+        status = aliccp::Reader::open_snapshot(FLAGS_snapshot, FLAGS_vocab, 1, FLAGS_snapshot_populate, false, &reader);
+    }
+    if (!status.ok()) {
+        fprintf(stderr, "open reader failed: %s\n", status.ToString().c_str());
+        return -1;
+    }
+
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (FLAGS_socket.size() >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "socket path too long: %s\n", FLAGS_socket.c_str());
+        return -1;
+    }
+    strncpy(addr.sun_path, FLAGS_socket.c_str(), sizeof(addr.sun_path) - 1);
+    ::unlink(FLAGS_socket.c_str());
+
+    auto listen_fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0 || ::bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 ||
+        ::listen(listen_fd, 128) < 0) {
+        fprintf(stderr, "listen on %s failed: %s\n", FLAGS_socket.c_str(), strerror(errno));
+        return -1;
+    }
+
+    MicroBatcher batcher(*reader, FLAGS_max_batch, FLAGS_max_wait_us, FLAGS_batch_threads);
+    fprintf(stderr, "feature server listening on %s\n", FLAGS_socket.c_str());
+
+    while (true) {
+        auto fd = ::accept(listen_fd, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "accept failed: %s\n", strerror(errno));
+            break;
+        }
+
+        std::thread(serve, fd, std::cref(*reader), std::ref(batcher), FLAGS_max_feats, FLAGS_max_request).detach();
+    }
+
+    ::close(listen_fd);
+    return 0;
+}
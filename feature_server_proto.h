@@ -0,0 +1,81 @@
+#ifndef __FEATURE_SERVER_PROTO_H__
+#define __FEATURE_SERVER_PROTO_H__
+
+#include <errno.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// wire format of feature_server, all integers are host byte order since both ends share
+// one machine.
+//
+// request:  RequestHeader, uint32 example_ids[n]
+// response: ResponseHeader, then if status == 0
+//               uint32 lens[n]
+//               uint32 feat_field_ids[nfeats]
+//               uint32 feat_ids[nfeats]      (vocab ids)
+//               float  values[nfeats]
+//               uint8  y[n]
+//               uint8  z[n]
+//           otherwise a message of nfeats bytes
+// features of example i are [sum(lens[:i]), sum(lens[:i+1])), already truncated to
+// max_feats of the server, exactly the unpadded rows of AliCCPRocksDB.
+namespace aliccp {
+
+static uint32_t const kRequestMagic = 0x41435251; // "ACRQ"
+static uint32_t const kResponseMagic = 0x41435250; // "ACRP"
+
+struct RequestHeader
+{
+    uint32_t magic;
+    uint32_t n;
+};
+
+struct ResponseHeader
+{
+    uint32_t magic;
+    int32_t status;
+    uint32_t n;
+    uint32_t nfeats;
+};
+
+static inline bool
+write_all(int fd, void const* buf, size_t size)
+{
+    auto p = static_cast<char const*>(buf);
+    while (size > 0) {
+        auto n = ::send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+static inline bool
+read_all(int fd, void* buf, size_t size)
+{
+    auto p = static_cast<char*>(buf);
+    while (size > 0) {
+        auto n = ::read(fd, p, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+
+    return true;
+}
+}
+
+#endif
@@ -0,0 +1,747 @@
+#include "input_stream.h"
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+namespace aliccp {
+
+namespace {
+
+size_t const kInflateInput = 1024 * 1024;
+// compressed bytes per parallel segment, a segment is cut at the first member that starts after it
+size_t const kSegmentSize = 16 * 1024 * 1024;
+// bytes after a cut point searched for a member start
+size_t const kMemberProbe = 1024 * 1024;
+size_t const kMaxMissedCuts = 4;
+// trial inflate that tells a member start from a magic that happens to be in deflate data
+size_t const kTrialInflate = 64 * 1024;
+size_t const kTarBlock = 512;
+// zlib decodes the gzip wrapper and checks crc and length of every member
+int const kGzipWindowBits = 16 + MAX_WBITS;
+
+std::string
+errno_message(std::string const& path)
+{
+    char buf[1024];
+    return path + ": " + strerror_r(errno, buf, sizeof(buf));
+}
+
+std::string
+zlib_message(z_stream const& zs, int const ret)
+{
+    return std::string("inflate failed: ") + (zs.msg ? zs.msg : std::to_string(ret));
+}
+
+bool
+is_member_start(const unsigned char* p, size_t const avail)
+{
+    // magic, deflate and no reserved flag bits
+    return avail >= 10 && p[0] == 0x1f && p[1] == 0x8b && p[2] == 8 && (p[3] & 0xe0) == 0;
+}
+
+// full reads, short only at the end
+ssize_t
+read_full(ByteSource& source, char* buf, size_t const n)
+{
+    size_t done = 0;
+    while (done < n) {
+        auto const r = source.read(buf + done, n - done);
+        if (r < 0) {
+            return -1;
+        }
+        if (r == 0) {
+            break;
+        }
+        done += r;
+    }
+    return done;
+}
+
+class FileSource : public ByteSource
+{
+  public:
+    FileSource(std::string const& path, int const fd)
+        : path_(path)
+        , fd_(fd)
+    {
+    }
+
+    ~FileSource() { ::close(fd_); }
+
+    ssize_t read(char* buf, size_t const n) override
+    {
+        ssize_t r;
+        do {
+            r = ::read(fd_, buf, n);
+        } while (r < 0 && errno == EINTR);
+
+        if (r < 0) {
+            error_ = errno_message(path_);
+        }
+        return r;
+    }
+
+  private:
+    std::string path_;
+    int fd_;
+};
+
+class MemorySource : public ByteSource
+{
+  public:
+    MemorySource(const char* data, size_t const size)
+        : data_(data)
+        , size_(size)
+    {
+    }
+
+    ssize_t read(char* buf, size_t const n) override
+    {
+        auto const len = std::min(n, size_ - pos_);
+        memcpy(buf, data_ + pos_, len);
+        pos_ += len;
+        return len;
+    }
+
+  private:
+    const char* data_;
+    size_t size_;
+    size_t pos_ = 0;
+};
+
+// gzip stream of any number of members, inflated as it is read
+class GzipSource : public ByteSource
+{
+  public:
+    explicit GzipSource(std::unique_ptr<ByteSource> input)
+        : input_(std::move(input))
+        , in_(kInflateInput)
+    {
+        memset(&zs_, 0, sizeof(zs_));
+        if (inflateInit2(&zs_, kGzipWindowBits) != Z_OK) {
+            error_ = "inflateInit2 failed";
+        }
+    }
+
+    ~GzipSource() { inflateEnd(&zs_); }
+
+    ssize_t read(char* buf, size_t const n) override
+    {
+        if (!error_.empty()) {
+            return -1;
+        }
+
+        zs_.next_out = reinterpret_cast<Bytef*>(buf);
+        zs_.avail_out = static_cast<uInt>(std::min<size_t>(n, UINT32_MAX));
+        auto const want = zs_.avail_out;
+
+        while (!end_ && zs_.avail_out == want) {
+            if (zs_.avail_in == 0 && !eof_) {
+                auto const r = input_->read(in_.data(), in_.size());
+                if (r < 0) {
+                    error_ = input_->error();
+                    return -1;
+                }
+                eof_ = r == 0;
+                zs_.next_in = reinterpret_cast<Bytef*>(in_.data());
+                zs_.avail_in = static_cast<uInt>(r);
+            }
+
+            if (zs_.avail_in == 0) {
+                if (in_member_) {
+                    error_ = "gzip stream is truncated";
+                    return -1;
+                }
+                end_ = true;
+                break;
+            }
+
+            // like gzip, trailing bytes that do not start another member end the stream
+            if (!in_member_ && zs_.next_in[0] != 0x1f) {
+                end_ = true;
+                break;
+            }
+
+            auto const ret = inflate(&zs_, Z_NO_FLUSH);
+            if (ret == Z_STREAM_END) {
+                in_member_ = false;
+                inflateReset(&zs_);
+            } else if (ret == Z_OK || ret == Z_BUF_ERROR) {
+                in_member_ = true;
+            } else {
+                error_ = zlib_message(zs_, ret);
+                return -1;
+            }
+        }
+        return want - zs_.avail_out;
+    }
+
+  private:
+    std::unique_ptr<ByteSource> input_;
+    std::vector<char> in_;
+    z_stream zs_;
+    bool in_member_ = false;
+    bool eof_ = false;
+    bool end_ = false;
+};
+
+// multi-member gzip file, e.g. bgzip output or concatenated gzip files. the file is cut into
+// segments at member starts, workers inflate segments in parallel a bounded window ahead of the
+// reader, who takes them in file order. a segment that does not end on a member end means a cut
+// was not a real member start, then the rest of the file is inflated sequentially from the last
+// good cut.
+class ParallelGzipSource : public ByteSource
+{
+  public:
+    ParallelGzipSource(const char* base, size_t const size, int const threads)
+        : base_(base)
+        , size_(size)
+        , window_(2 * static_cast<size_t>(threads))
+    {
+        starts_.push_back(0);
+        for (size_t offset = kSegmentSize; offset < size_; offset += kSegmentSize) {
+            // a single member stream has no start past 0, give up early instead of scanning it all
+            if (starts_.size() == 1 && offset >= kMaxMissedCuts * kSegmentSize) {
+                break;
+            }
+            auto const lo = std::max(offset, starts_.back() + 1);
+            auto const start = find_member(lo, lo + kMemberProbe);
+            if (start < size_) {
+                starts_.push_back(start);
+            }
+        }
+        starts_.push_back(size_);
+        segments_.resize(starts_.size() - 1);
+
+        if (segments_.size() == 1) {
+            // single member, nothing to run in parallel
+            fallback_.reset(new GzipSource(std::unique_ptr<ByteSource>(new MemorySource(base_, size_))));
+            return;
+        }
+
+        for (int i = 0; i < threads; ++i) {
+            workers_.emplace_back(&ParallelGzipSource::work, this);
+        }
+    }
+
+    ~ParallelGzipSource()
+    {
+        stop();
+        ::munmap(const_cast<char*>(base_), size_);
+    }
+
+    ssize_t read(char* buf, size_t const n) override
+    {
+        while (!fallback_ && current_ < segments_.size()) {
+            auto& segment = segments_[current_];
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cond_.wait(lock, [&] { return segment.state != Segment::kPending; });
+            }
+
+            if (segment.state == Segment::kFailed) {
+                stop();
+                auto const start = starts_[current_];
+                fallback_.reset(
+                  new GzipSource(std::unique_ptr<ByteSource>(new MemorySource(base_ + start, size_ - start))));
+                break;
+            }
+
+            if (pos_ < segment.data.size()) {
+                auto const len = std::min(n, segment.data.size() - pos_);
+                memcpy(buf, segment.data.data() + pos_, len);
+                pos_ += len;
+                return len;
+            }
+
+            std::string().swap(segment.data);
+            pos_ = 0;
+            std::lock_guard<std::mutex> lock(mutex_);
+            ++current_;
+            cond_.notify_all();
+        }
+
+        if (!fallback_) {
+            return 0;
+        }
+        auto const r = fallback_->read(buf, n);
+        if (r < 0) {
+            error_ = fallback_->error();
+        }
+        return r;
+    }
+
+  private:
+    struct Segment
+    {
+        enum State
+        {
+            kPending,
+            kDone,
+            kFailed
+        };
+
+        std::string data;
+        State state = kPending;
+    };
+
+    // offset of the first member start in [lo, hi), size_ if there is none
+    size_t find_member(size_t const lo, size_t const hi) const
+    {
+        auto const ubase = reinterpret_cast<const unsigned char*>(base_);
+        auto const end = std::min(hi, size_);
+        for (auto pos = lo; pos < end;) {
+            auto const p = static_cast<const unsigned char*>(memchr(ubase + pos, 0x1f, end - pos));
+            if (!p) {
+                break;
+            }
+            pos = p - ubase;
+            if (is_member_start(p, size_ - pos) && trial_inflate(pos)) {
+                return pos;
+            }
+            ++pos;
+        }
+        return size_;
+    }
+
+    bool trial_inflate(size_t const start) const
+    {
+        std::vector<Bytef> out(kTrialInflate);
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        if (inflateInit2(&zs, kGzipWindowBits) != Z_OK) {
+            return false;
+        }
+        zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(base_ + start));
+        zs.avail_in = static_cast<uInt>(std::min(kTrialInflate, size_ - start));
+        zs.next_out = out.data();
+        zs.avail_out = static_cast<uInt>(out.size());
+
+        auto const ret = inflate(&zs, Z_NO_FLUSH);
+        auto const produced = zs.avail_out < out.size();
+        inflateEnd(&zs);
+        return ret == Z_STREAM_END || ((ret == Z_OK || ret == Z_BUF_ERROR) && produced);
+    }
+
+    // members of a segment must end exactly at its end
+    bool inflate_segment(size_t const k, std::string& data) const
+    {
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        if (inflateInit2(&zs, kGzipWindowBits) != Z_OK) {
+            return false;
+        }
+        zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(base_ + starts_[k]));
+        zs.avail_in = static_cast<uInt>(starts_[k + 1] - starts_[k]);
+
+        auto ok = false;
+        size_t out = 0;
+        while (true) {
+            if (data.size() - out < kInflateInput) {
+                data.resize(std::max(2 * data.size(), out + kInflateInput));
+            }
+            zs.next_out = reinterpret_cast<Bytef*>(&data[out]);
+            zs.avail_out = static_cast<uInt>(std::min<size_t>(data.size() - out, UINT32_MAX));
+            auto const avail_out = zs.avail_out;
+
+            auto const ret = inflate(&zs, Z_NO_FLUSH);
+            out += avail_out - zs.avail_out;
+            if (ret == Z_STREAM_END) {
+                if (zs.avail_in == 0) {
+                    ok = true;
+                    break;
+                }
+                if (!is_member_start(zs.next_in, zs.avail_in)) {
+                    break;
+                }
+                inflateReset(&zs);
+            } else if (ret != Z_OK) {
+                // Z_BUF_ERROR here means a member runs past the segment end
+                break;
+            }
+        }
+        data.resize(out);
+        inflateEnd(&zs);
+        return ok;
+    }
+
+    void work()
+    {
+        while (true) {
+            size_t k;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cond_.wait(lock, [&] {
+                    return stop_ || next_ >= segments_.size() || next_ < current_ + window_;
+                });
+                if (stop_ || next_ >= segments_.size()) {
+                    return;
+                }
+                k = next_++;
+            }
+
+            std::string data;
+            auto const ok = inflate_segment(k, data);
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            segments_[k].data.swap(data);
+            segments_[k].state = ok ? Segment::kDone : Segment::kFailed;
+            cond_.notify_all();
+        }
+    }
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+            cond_.notify_all();
+        }
+        for (auto& worker : workers_) {
+            worker.join();
+        }
+        workers_.clear();
+    }
+
+    const char* base_;
+    size_t size_;
+    size_t window_;
+    // segment k is [starts_[k], starts_[k + 1])
+    std::vector<size_t> starts_;
+    std::vector<Segment> segments_;
+    // next segment to hand to a worker
+    size_t next_ = 0;
+    // segment being read and the read position inside it
+    size_t current_ = 0;
+    size_t pos_ = 0;
+    bool stop_ = false;
+    std::unique_ptr<ByteSource> fallback_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::vector<std::thread> workers_;
+};
+
+// one member of a tar stream. ustar prefixes, gnu long names and pax path records are understood
+class TarSource : public ByteSource
+{
+  public:
+    TarSource(std::unique_ptr<ByteSource> input, std::string const& member)
+        : input_(std::move(input))
+        , member_(member)
+    {
+    }
+
+    ssize_t read(char* buf, size_t const n) override
+    {
+        if (!found_ && !find()) {
+            return -1;
+        }
+        if (remaining_ == 0) {
+            return 0;
+        }
+
+        auto const r = input_->read(buf, static_cast<size_t>(std::min<uint64_t>(n, remaining_)));
+        if (r < 0) {
+            error_ = input_->error();
+            return -1;
+        }
+        if (r == 0) {
+            error_ = "tar member " + member_ + " is truncated";
+            return -1;
+        }
+        remaining_ -= r;
+        return r;
+    }
+
+  private:
+    // octal, or base-256 for sizes of 8GB and up
+    static bool parse_size(const char* field, size_t const len, uint64_t& size)
+    {
+        auto const p = reinterpret_cast<const unsigned char*>(field);
+        size = 0;
+        if (p[0] & 0x80) {
+            size = p[0] & 0x7f;
+            for (size_t i = 1; i < len; ++i) {
+                size = (size << 8) | p[i];
+            }
+            return true;
+        }
+
+        size_t i = 0;
+        while (i < len && p[i] == ' ') {
+            ++i;
+        }
+        for (; i < len && p[i] >= '0' && p[i] <= '7'; ++i) {
+            size = (size << 3) | (p[i] - '0');
+        }
+        return i == len || p[i] == ' ' || p[i] == '\0';
+    }
+
+    static std::string header_name(const char* header)
+    {
+        std::string name(header, strnlen(header, 100));
+        if (memcmp(header + 257, "ustar", 5) == 0 && header[345] != '\0') {
+            name = std::string(header + 345, strnlen(header + 345, 155)) + "/" + name;
+        }
+        return name;
+    }
+
+    // records are "<len> <key>=<value>\n"
+    static std::string pax_path(std::string const& data)
+    {
+        size_t pos = 0;
+        while (pos < data.size()) {
+            auto const len = strtoull(data.c_str() + pos, nullptr, 10);
+            auto const space = data.find(' ', pos);
+            if (len == 0 || space == std::string::npos || pos + len > data.size()) {
+                break;
+            }
+
+            auto const record = data.substr(space + 1, pos + len - space - 2);
+            if (record.compare(0, 5, "path=") == 0) {
+                return record.substr(5);
+            }
+            pos += len;
+        }
+        return "";
+    }
+
+    bool matches(std::string const& name) const
+    {
+        auto const suffix = "/" + member_;
+        return name == member_ ||
+               (name.size() > suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0);
+    }
+
+    bool read_data(uint64_t const size, std::string* data)
+    {
+        std::vector<char> buf(kInflateInput);
+        auto left = (size + kTarBlock - 1) / kTarBlock * kTarBlock;
+        while (left > 0) {
+            auto const len = static_cast<size_t>(std::min<uint64_t>(left, buf.size()));
+            auto const r = read_full(*input_, buf.data(), len);
+            if (r < 0) {
+                error_ = input_->error();
+                return false;
+            }
+            if (static_cast<size_t>(r) < len) {
+                error_ = "tar archive is truncated";
+                return false;
+            }
+            if (data && data->size() < size) {
+                data->append(buf.data(), static_cast<size_t>(std::min<uint64_t>(len, size - data->size())));
+            }
+            left -= len;
+        }
+        return true;
+    }
+
+    bool find()
+    {
+        if (!error_.empty()) {
+            return false;
+        }
+
+        char header[kTarBlock];
+        std::string next_name;
+        while (true) {
+            auto const r = read_full(*input_, header, kTarBlock);
+            if (r < 0) {
+                error_ = input_->error();
+                return false;
+            }
+            if (static_cast<size_t>(r) < kTarBlock || header[0] == '\0') {
+                error_ = "tar member " + member_ + " is not in the archive";
+                return false;
+            }
+
+            uint64_t size;
+            if (!parse_size(header + 124, 12, size)) {
+                error_ = "bad tar header";
+                return false;
+            }
+
+            auto const type = header[156];
+            auto const name = next_name.empty() ? header_name(header) : next_name;
+            next_name.clear();
+
+            // long name and pax headers describe the entry after them
+            if (type == 'L' || type == 'x') {
+                std::string data;
+                if (!read_data(size, &data)) {
+                    return false;
+                }
+                next_name = type == 'L' ? std::string(data.c_str()) : pax_path(data);
+                continue;
+            }
+
+            if ((type == '0' || type == '\0') && matches(name)) {
+                found_ = true;
+                remaining_ = size;
+                return true;
+            }
+
+            if (!read_data(size, nullptr)) {
+                return false;
+            }
+        }
+    }
+
+    std::unique_ptr<ByteSource> input_;
+    std::string member_;
+    bool found_ = false;
+    uint64_t remaining_ = 0;
+};
+}
+
+std::unique_ptr<ByteSource>
+open_input(std::string const& path, std::string const& tar_member, int const decode_threads, std::string* err)
+{
+    auto fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        *err = errno_message(path);
+        return nullptr;
+    }
+
+    unsigned char magic[10];
+    auto const n = ::pread(fd, magic, sizeof(magic), 0);
+    if (n < 0) {
+        *err = errno_message(path);
+        ::close(fd);
+        return nullptr;
+    }
+
+    std::unique_ptr<ByteSource> source;
+    if (!is_member_start(magic, n) || decode_threads <= 1) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        source.reset(new FileSource(path, fd));
+        if (is_member_start(magic, n)) {
+            source.reset(new GzipSource(std::move(source)));
+        }
+    } else {
+        struct stat st;
+        if (::fstat(fd, &st) < 0) {
+            *err = errno_message(path);
+            ::close(fd);
+            return nullptr;
+        }
+
+        auto const size = static_cast<size_t>(st.st_size);
+        auto addr = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (addr == MAP_FAILED) {
+            *err = errno_message(path);
+            return nullptr;
+        }
+        ::madvise(addr, size, MADV_SEQUENTIAL);
+        source.reset(new ParallelGzipSource(static_cast<const char*>(addr), size, decode_threads));
+    }
+
+    if (!tar_member.empty()) {
+        source.reset(new TarSource(std::move(source), tar_member));
+    }
+    return source;
+}
+
+LineReader::LineReader(std::unique_ptr<ByteSource> source, size_t const chunk_size, size_t const nchunks)
+    : source_(std::move(source))
+    , ring_(std::max<size_t>(nchunks, 2))
+{
+    for (auto& chunk : ring_) {
+        chunk.data.resize(chunk_size);
+    }
+    thread_ = std::thread(&LineReader::produce, this);
+}
+
+LineReader::~LineReader()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+        cond_.notify_all();
+    }
+    thread_.join();
+}
+
+void
+LineReader::produce()
+{
+    while (true) {
+        size_t slot;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cond_.wait(lock, [&] { return stop_ || count_ < ring_.size(); });
+            if (stop_) {
+                return;
+            }
+            slot = (head_ + count_) % ring_.size();
+        }
+
+        // the slot is outside [head_, head_ + count_), the consumer does not touch it
+        auto& chunk = ring_[slot];
+        auto const r = read_full(*source_, chunk.data.data(), chunk.data.size());
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (r < 0) {
+            error_ = source_->error();
+            done_ = true;
+        } else {
+            chunk.size = r;
+            if (r > 0) {
+                ++count_;
+            }
+            done_ = static_cast<size_t>(r) < chunk.data.size();
+        }
+        cond_.notify_all();
+        if (done_) {
+            return;
+        }
+    }
+}
+
+bool
+LineReader::getline(std::string& line)
+{
+    line.clear();
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cond_.wait(lock, [&] { return count_ > 0 || done_; });
+            if (count_ == 0) {
+                // a last line without '\n' still counts
+                return error_.empty() && !line.empty();
+            }
+        }
+
+        auto const& chunk = ring_[head_];
+        auto const begin = chunk.data.data() + pos_;
+        auto const end = chunk.data.data() + chunk.size;
+        auto const newline = static_cast<const char*>(memchr(begin, '\n', end - begin));
+        line.append(begin, newline ? newline : end);
+        pos_ = newline ? newline + 1 - chunk.data.data() : chunk.size;
+
+        if (pos_ == chunk.size) {
+            pos_ = 0;
+            std::lock_guard<std::mutex> lock(mutex_);
+            head_ = (head_ + 1) % ring_.size();
+            --count_;
+            cond_.notify_all();
+        }
+        if (newline) {
+            return true;
+        }
+    }
+}
+
+std::string
+LineReader::error() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return error_;
+}
+}
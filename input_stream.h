@@ -0,0 +1,77 @@
+#ifndef __ALICCP_INPUT_STREAM_H__
+#define __ALICCP_INPUT_STREAM_H__
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+#include <thread>
+#include <vector>
+
+namespace aliccp {
+
+// sequential bytes of an ingest input
+class ByteSource
+{
+  public:
+    virtual ~ByteSource() {}
+
+    // bytes read into buf, 0 at the end, -1 on error
+    virtual ssize_t read(char* buf, size_t const n) = 0;
+
+    std::string const& error() const { return error_; }
+
+  protected:
+    std::string error_;
+};
+
+// plain or gzip file, gzip is detected by its magic. a non-empty tar_member picks that member out
+// of a tar archive, a member matches by its full path or its base name. decode_threads > 1
+// inflates the members of a multi-member gzip in parallel, single member streams are inflated
+// by one thread whatever decode_threads is.
+std::unique_ptr<ByteSource>
+open_input(std::string const& path, std::string const& tar_member, int const decode_threads, std::string* err);
+
+// lines of a source without the trailing '\n'. the source is read on a dedicated thread that
+// fills a ring of chunks ahead of the parser.
+class LineReader
+{
+  public:
+    explicit LineReader(std::unique_ptr<ByteSource> source,
+                        size_t const chunk_size = 4 * 1024 * 1024,
+                        size_t const nchunks = 8);
+    ~LineReader();
+
+    // false at the end of the input or on error
+    bool getline(std::string& line);
+
+    // empty unless the source failed
+    std::string error() const;
+
+  private:
+    struct Chunk
+    {
+        std::vector<char> data;
+        size_t size = 0;
+    };
+
+    void produce();
+
+    std::unique_ptr<ByteSource> source_;
+    std::vector<Chunk> ring_;
+    // ring_[head_] is the oldest filled chunk, count_ chunks are filled
+    size_t head_ = 0;
+    size_t count_ = 0;
+    // read position inside ring_[head_], only touched by the consumer
+    size_t pos_ = 0;
+    bool done_ = false;
+    bool stop_ = false;
+    std::string error_;
+    mutable std::mutex mutex_;
+    std::condition_variable cond_;
+    std::thread thread_;
+};
+}
+
+#endif
@@ -0,0 +1,145 @@
+#include "aliccp_key.h"
+#include "aliccp_options.h"
+#include <gflags/gflags.h>
+#include <rocksdb/db.h>
+#include <rocksdb/options.h>
+#include <rocksdb/table.h>
+#include <rocksdb/write_batch.h>
+
+// the destination is written with the sst layout of the profile it will be read with
+static rocksdb::Status
+open_db(const char* path, aliccp::DbProfile::Kind const profile, rocksdb::DB** db, bool const readonly)
+{
+    rocksdb::Options opt;
+    opt.create_if_missing = !readonly;
+    opt.error_if_exists = !readonly;
+    opt.max_open_files = 3000;
+    opt.write_buffer_size = 500 * 1024 * 1024;
+    opt.max_write_buffer_number = 3;
+    opt.target_file_size_base = 67108864;
+    opt.compression = rocksdb::kZlibCompression;
+
+    rocksdb::BlockBasedTableOptions table_opt;
+    aliccp::set_table_layout(profile, &table_opt);
+    table_opt.block_cache = rocksdb::NewLRUCache(1000 * (1024 * 1024));
+    table_opt.block_cache_compressed = rocksdb::NewLRUCache(500 * (1024 * 1024));
+    opt.table_factory.reset(rocksdb::NewBlockBasedTableFactory(table_opt));
+    if (readonly) {
+        return rocksdb::DB::OpenForReadOnly(opt, path, db);
+    }
+    return rocksdb::DB::Open(opt, path, db);
+}
+
+// copies src into dst with big endian example keys, values and other keys are copied as they are.
+// src is scanned in its legacy key order, so dst is compacted once at the end to sort it.
+static int
+migrate(rocksdb::DB* src, uint32_t const src_key_format, rocksdb::DB* dst, int const batch_size)
+{
+    rocksdb::ReadOptions read_opt;
+    read_opt.fill_cache = false;
+    read_opt.readahead_size = 2 * 1024 * 1024;
+    rocksdb::WriteOptions write_opt;
+    write_opt.disableWAL = true;
+
+    std::unique_ptr<rocksdb::Iterator> it(src->NewIterator(read_opt));
+    rocksdb::WriteBatch batch;
+    uint64_t cnt = 0;
+    for (it->SeekToFirst(); it->Valid(); it->Next()) {
+        auto const key = it->key();
+        if (key == rocksdb::Slice(aliccp::kKeyFormatKey)) {
+            continue;
+        }
+
+        if (key.size() == aliccp::kExampleKeySize) {
+            char migrated[aliccp::kExampleKeySize];
+            auto const example_id = aliccp::decode_example_key(key.data(), src_key_format);
+            aliccp::encode_example_key(example_id, aliccp::kKeyFormatBigEndian, migrated);
+            batch.Put(rocksdb::Slice(migrated, sizeof(migrated)), it->value());
+        } else {
+            batch.Put(key, it->value());
+        }
+
+        if (++cnt % batch_size == 0) {
+            auto status = dst->Write(write_opt, &batch);
+            if (!status.ok()) {
+                fprintf(stderr, "write failed: %s\n", status.ToString().c_str());
+                return -1;
+            }
+            batch.Clear();
+            fprintf(stderr, "migrate %lu keys\n", cnt);
+        }
+    }
+
+    if (!it->status().ok()) {
+        fprintf(stderr, "scan failed: %s\n", it->status().ToString().c_str());
+        return -1;
+    }
+
+    auto status = dst->Write(write_opt, &batch);
+    if (status.ok()) {
+        status = aliccp::write_key_format(dst, aliccp::kKeyFormatBigEndian);
+    }
+    if (status.ok()) {
+        status = dst->Flush(rocksdb::FlushOptions());
+    }
+    if (status.ok()) {
+        status = dst->CompactRange(rocksdb::CompactRangeOptions(), nullptr, nullptr);
+    }
+    if (!status.ok()) {
+        fprintf(stderr, "finish failed: %s\n", status.ToString().c_str());
+        return -1;
+    }
+
+    fprintf(stderr, "migrate %lu keys done\n", cnt);
+    return 0;
+}
+
+DEFINE_string(src_db, "", "Path to examples db to migrate");
+DEFINE_string(dst_db, "", "Path to new examples db with big endian keys, must not exist");
+DEFINE_int32(batch, 100000, "batch size");
+DEFINE_string(db_profile, "default", "sst layout of dst_db, default or point_lookup, read it with the same profile");
+
+int
+main(int argc, char* argv[])
+{
+    google::ParseCommandLineFlags(&argc, &argv, true);
+    if (FLAGS_src_db.empty() || FLAGS_dst_db.empty() || FLAGS_batch <= 0) {
+        fprintf(stderr, "src_db, dst_db, batch > 0 are required\n");
+        return -1;
+    }
+
+    aliccp::DbProfile::Kind profile;
+    auto status = aliccp::parse_db_profile(FLAGS_db_profile, &profile);
+    if (!status.ok()) {
+        fprintf(stderr, "%s\n", status.ToString().c_str());
+        return -1;
+    }
+
+    rocksdb::DB* p = nullptr;
+    status = open_db(FLAGS_src_db.c_str(), profile, &p, true);
+    if (!status.ok()) {
+        fprintf(stderr, "open db %s failed. what: %s\n", FLAGS_src_db.c_str(), status.ToString().c_str());
+        return -1;
+    }
+    std::unique_ptr<rocksdb::DB> src(p);
+
+    uint32_t key_format;
+    status = aliccp::read_key_format(src.get(), &key_format);
+    if (!status.ok()) {
+        fprintf(stderr, "read key format of %s failed: %s\n", FLAGS_src_db.c_str(), status.ToString().c_str());
+        return -1;
+    }
+    if (key_format == aliccp::kKeyFormatBigEndian) {
+        fprintf(stderr, "%s already has big endian keys\n", FLAGS_src_db.c_str());
+        return 0;
+    }
+
+    status = open_db(FLAGS_dst_db.c_str(), profile, &p, false);
+    if (!status.ok()) {
+        fprintf(stderr, "open db %s failed. what: %s\n", FLAGS_dst_db.c_str(), status.ToString().c_str());
+        return -1;
+    }
+    std::unique_ptr<rocksdb::DB> dst(p);
+
+    return migrate(src.get(), key_format, dst.get(), FLAGS_batch);
+}
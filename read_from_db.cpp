@@ -1,3 +1,4 @@
+#include "aliccp_key.h"
 #include "comm_feats_generated.h"
 #include "example_generated.h"
 #include "feature_generated.h"
@@ -30,13 +31,14 @@ print_example(aliccp::Example const* example)
 {
     fprintf(stderr,
             "Get example: example_id = %u, y = %d, z = %d, comm_feat_idx = %s, feat_num = %u, nfeats "
-            "= %u\n",
+            "= %u, joined = %d\n",
             example->example_id(),
             example->y(),
             example->z(),
             example->comm_feat_id()->c_str(),
             example->feat_num(),
-            example->feats()->Length());
+            example->feats()->Length(),
+            example->joined());
 
     for (auto const& feat : *example->feats()) {
         fprintf(stderr,
@@ -90,14 +92,22 @@ main(int argc, char* argv[])
     boost::split(keys, FLAGS_keys, boost::is_any_of(","));
 
     auto const isexample = FLAGS_type == "example";
+    uint32_t key_format = aliccp::kKeyFormatLegacy;
+    if (isexample) {
+        status = aliccp::read_key_format(db.get(), &key_format);
+        if (!status.ok()) {
+            fprintf(stderr, "read key format of %s failed: %s\n", FLAGS_db.c_str(), status.ToString().c_str());
+            return -1;
+        }
+    }
 
     for (auto const& key : keys) {
         std::string value;
-        uint32_t u32key = 0;
+        char example_key[aliccp::kExampleKeySize];
         rocksdb::Slice skey;
         if (isexample) {
-            u32key = static_cast<uint32_t>(std::stoul(key));
-            skey = rocksdb::Slice(reinterpret_cast<char*>(&u32key), sizeof(u32key));
+            aliccp::encode_example_key(static_cast<uint32_t>(std::stoul(key)), key_format, example_key);
+            skey = rocksdb::Slice(example_key, sizeof(example_key));
         } else {
             skey = key;
         }
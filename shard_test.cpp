@@ -0,0 +1,97 @@
+#include "aliccp_key.h"
+#include "aliccp_shard.h"
+#include <algorithm>
+#include <rocksdb/db.h>
+#include <rocksdb/options.h>
+#include <stdlib.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+static int failures = 0;
+
+#define EXPECT(cond)                                                                                                   \
+    do {                                                                                                               \
+        if (!(cond)) {                                                                                                 \
+            fprintf(stderr, "%s:%d: expect %s\n", __FILE__, __LINE__, #cond);                                          \
+            ++failures;                                                                                                \
+        }                                                                                                              \
+    } while (0)
+
+// every worker gets the same number of ranges, every id goes to exactly one worker and no worker
+// gets more than twice its share
+static void
+check_shards(rocksdb::DB* db, std::vector<uint32_t> const& ids, int const num_workers, int const ranges_per_worker)
+{
+    std::vector<aliccp::KeyRange> ranges;
+    auto status = aliccp::split_key_ranges(db, num_workers * ranges_per_worker, &ranges);
+    EXPECT(status.ok());
+    EXPECT(static_cast<int>(ranges.size()) == num_workers * ranges_per_worker);
+
+    std::vector<uint32_t> all;
+    for (auto worker = 0; worker < num_workers; ++worker) {
+        auto const owned = aliccp::worker_ranges(ranges.size(), num_workers, worker, 2020, 0);
+        EXPECT(static_cast<int>(owned.size()) == ranges_per_worker);
+
+        std::vector<uint32_t> shard;
+        for (auto const i : owned) {
+            EXPECT(aliccp::range_ids(db, ranges[i], aliccp::kKeyFormatBigEndian, &shard).ok());
+        }
+        EXPECT(shard.size() <= 2 * ids.size() / num_workers);
+        all.insert(all.end(), shard.cbegin(), shard.cend());
+    }
+
+    std::sort(all.begin(), all.end());
+    EXPECT(all == ids);
+}
+
+int
+main()
+{
+    char dir[] = "/tmp/aliccp_shard_test_XXXXXX";
+    if (!mkdtemp(dir)) {
+        fprintf(stderr, "mkdtemp failed\n");
+        return 1;
+    }
+    auto const path = std::string(dir) + "/examples.db";
+
+    rocksdb::Options opt;
+    opt.create_if_missing = true;
+    rocksdb::DB* p = nullptr;
+    auto status = rocksdb::DB::Open(opt, path, &p);
+    if (!status.ok()) {
+        fprintf(stderr, "open %s failed: %s\n", path.c_str(), status.ToString().c_str());
+        return 1;
+    }
+    std::unique_ptr<rocksdb::DB> db(p);
+
+    std::vector<uint32_t> ids;
+    for (uint32_t id = 1000; id < 1400; ++id) {
+        char key[aliccp::kExampleKeySize];
+        aliccp::encode_example_key(id, aliccp::kKeyFormatBigEndian, key);
+        EXPECT(db->Put(rocksdb::WriteOptions(), rocksdb::Slice(key, sizeof(key)), "x").ok());
+        ids.push_back(id);
+    }
+    EXPECT(aliccp::write_key_format(db.get(), aliccp::kKeyFormatBigEndian).ok());
+
+    // all keys still in the memtable, there is no sst file to cut at
+    check_shards(db.get(), ids, 4, 2);
+
+    // a single sst file gives a single cut point, far fewer than the ranges
+    EXPECT(db->Flush(rocksdb::FlushOptions()).ok());
+    check_shards(db.get(), ids, 4, 2);
+
+    // fewer keys than ranges leaves ranges empty but still deals them evenly
+    check_shards(db.get(), ids, 8, 64);
+
+    db.reset();
+    rocksdb::DestroyDB(path, opt);
+    rmdir(dir);
+
+    if (failures) {
+        fprintf(stderr, "%d failures\n", failures);
+        return 1;
+    }
+    fprintf(stderr, "shard_test passed\n");
+    return 0;
+}
@@ -0,0 +1,136 @@
+#ifndef __ALICCP_THREAD_POOL_H__
+#define __ALICCP_THREAD_POOL_H__
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace aliccp {
+
+// runs fn over shards of [0, total), lets a host framework lend its own worker pool
+using ParallelFor =
+    std::function<void(int64_t total, int64_t cost_per_unit, std::function<void(int64_t, int64_t)> const& fn)>;
+
+// fixed size pool for the framework-neutral loader, same ParallelFor contract as the
+// tensorflow cpu worker pool so both can drive Reader::fill
+class ThreadPool
+{
+  public:
+    explicit ThreadPool(int num_threads)
+    {
+        if (num_threads <= 0) {
+            num_threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+
+        for (auto i = 0; i < num_threads; ++i) {
+            threads_.emplace_back(&ThreadPool::run, this);
+        }
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        cond_.notify_all();
+        for (auto& t : threads_) {
+            t.join();
+        }
+    }
+
+    int num_threads() const { return static_cast<int>(threads_.size()); }
+
+    // runs fn over contiguous shards of [0, total) and blocks until all shards are done, the
+    // calling thread takes shards as well. small jobs run inline.
+    void parallel_for(int64_t const total,
+                      int64_t const cost_per_unit,
+                      std::function<void(int64_t, int64_t)> const& fn)
+    {
+        if (total <= 0) {
+            return;
+        }
+
+        auto const nshards = std::min<int64_t>(total, threads_.size() + 1);
+        if (nshards == 1 || total * cost_per_unit < kMinParallelCost) {
+            fn(0, total);
+            return;
+        }
+
+        struct Job
+        {
+            std::atomic<int64_t> next{ 0 };
+            int64_t done = 0;
+            std::mutex mutex;
+            std::condition_variable cond;
+        };
+
+        auto const block = (total + nshards - 1) / nshards;
+        std::shared_ptr<Job> job(new Job);
+        auto work = [job, block, total, nshards, &fn]() {
+            int64_t finished = 0;
+            for (auto shard = job->next++; shard < nshards; shard = job->next++) {
+                fn(shard * block, std::min(total, (shard + 1) * block));
+                ++finished;
+            }
+
+            if (finished > 0) {
+                std::lock_guard<std::mutex> lock(job->mutex);
+                job->done += finished;
+                job->cond.notify_all();
+            }
+        };
+
+        for (auto i = 1; i < nshards; ++i) {
+            schedule(work);
+        }
+        work();
+
+        std::unique_lock<std::mutex> lock(job->mutex);
+        job->cond.wait(lock, [&job, nshards] { return job->done == nshards; });
+    }
+
+  private:
+    static int64_t const kMinParallelCost = 10000;
+
+    void schedule(std::function<void()> task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            tasks_.push_back(std::move(task));
+        }
+        cond_.notify_one();
+    }
+
+    void run()
+    {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cond_.wait(lock, [this] { return stop_ || !tasks_.empty(); });
+                if (tasks_.empty()) {
+                    return;
+                }
+                task = std::move(tasks_.front());
+                tasks_.pop_front();
+            }
+            task();
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::deque<std::function<void()>> tasks_;
+    bool stop_ = false;
+    std::vector<std::thread> threads_;
+};
+}
+
+#endif
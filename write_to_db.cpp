@@ -1,11 +1,17 @@
+#include "aliccp_key.h"
+#include "aliccp_options.h"
 #include "comm_feats_generated.h"
 #include "example_generated.h"
 #include "feature_generated.h"
+#include "input_stream.h"
+#include "label_index_generated.h"
+#include "lens_index_generated.h"
 #include "vocab_generated.h"
 #include <boost/algorithm/string.hpp>
 #include <fstream>
 #include <gflags/gflags.h>
 #include <iostream>
+#include <limits>
 #include <rocksdb/db.h>
 #include <rocksdb/options.h>
 #include <rocksdb/table.h>
@@ -66,9 +72,26 @@ print_comm_feats(aliccp::CommFeature const* comm_feats)
 }
 
 static std::unordered_map<uint32_t, std::unordered_map<uint32_t, uint32_t>> field_stat;
+static std::vector<uint8_t> exists_bitmap;
+static std::vector<uint8_t> y_bitmap;
+static std::vector<uint8_t> z_bitmap;
+
+static void
+set_bit(std::vector<uint8_t>& bitmap, uint32_t const i, bool const on)
+{
+    if (bitmap.size() <= i / 8) {
+        bitmap.resize(i / 8 + 1, 0);
+    }
+
+    if (on) {
+        bitmap[i / 8] |= static_cast<uint8_t>(1u << (i % 8));
+    }
+}
+// every feature counts in field_stat, only the first limit ones are written
 static int
 parse_feats(flatbuffers::FlatBufferBuilder& builder,
             std::string const& line,
+            size_t const limit,
             std::vector<flatbuffers::Offset<aliccp::Feature>>& vfeats)
 {
     std::vector<std::string> feats;
@@ -96,14 +119,77 @@ parse_feats(flatbuffers::FlatBufferBuilder& builder,
         auto const feat_id = static_cast<uint32_t>(std::stoul(ids[1]));
         auto const value = std::stof(kv[1]);
         field_stat[feat_field_id][feat_id] += 1;
-        vfeats.push_back(aliccp::CreateFeature(builder, feat_field_id, feat_id, value));
+        if (vfeats.size() < limit) {
+            vfeats.push_back(aliccp::CreateFeature(builder, feat_field_id, feat_id, value));
+        }
     }
 
     return 0;
 }
 
+// comm feats of a skeleton row for -prejoin, consecutive rows often share their comm_feat_id
+class CommFeatJoiner
+{
+  public:
+    CommFeatJoiner(rocksdb::DB* db, size_t const max_feats)
+        : db_(db)
+        , max_feats_(max_feats)
+    {
+    }
+
+    size_t max_feats() const { return max_feats_; }
+    // rows whose comm_feat_id is not in the db, they are written with their own feats only
+    uint64_t misses() const { return misses_; }
+
+    // *comm_feat is nullptr if the db has no such comm feature, other read errors are returned
+    rocksdb::Status lookup(std::string const& comm_feat_id, aliccp::CommFeature const** comm_feat)
+    {
+        if (comm_feat_id != last_id_) {
+            // a failed read is not cached, the id is read again for its next row
+            last_id_.clear();
+            auto status = db_->Get(rocksdb::ReadOptions(), comm_feat_id, &value_);
+            if (!status.ok() && !status.IsNotFound()) {
+                return status;
+            }
+            last_id_ = comm_feat_id;
+            found_ = status.ok();
+        }
+
+        *comm_feat = nullptr;
+        if (!found_) {
+            ++misses_;
+            return rocksdb::Status::OK();
+        }
+        *comm_feat = aliccp::GetCommFeature(value_.data());
+        return rocksdb::Status::OK();
+    }
+
+  private:
+    rocksdb::DB* db_;
+    size_t max_feats_;
+    std::string last_id_;
+    std::string value_;
+    bool found_ = false;
+    uint64_t misses_ = 0;
+};
+
+// feature lengths for -lens_index, comm feat lengths are collected first and added to the
+// lengths of their examples
+struct LensCollector
+{
+    std::unordered_map<std::string, uint32_t> comm_feat_lens;
+    std::vector<aliccp::LenEntry> example_lens;
+};
+
+// joiner is nullptr unless -prejoin, then the record holds the row's features followed by its
+// comm feats, cut at joiner->max_feats(). lens is nullptr unless -lens_index.
 static int
-parse_skeleton_line(flatbuffers::FlatBufferBuilder& builder, std::string const& line, std::vector<char>& key)
+parse_skeleton_line(flatbuffers::FlatBufferBuilder& builder,
+                    std::string const& line,
+                    uint32_t const key_format,
+                    CommFeatJoiner* joiner,
+                    LensCollector* lens,
+                    std::vector<char>& key)
 {
     std::vector<std::string> items;
     boost::split(items, line, boost::is_any_of(","));
@@ -118,24 +204,58 @@ parse_skeleton_line(flatbuffers::FlatBufferBuilder& builder, std::string const&
     auto const& feat_idx = items[3];
     auto const feat_num = static_cast<uint16_t>(std::stoul(items[4]));
     auto const& feats = items[5];
-    const char* p = reinterpret_cast<const char*>(&example_id);
-    for (auto i = 0; i < sizeof(example_id); ++i) {
-        key.push_back(p[i]);
-    }
+    key.resize(aliccp::kExampleKeySize);
+    aliccp::encode_example_key(example_id, key_format, key.data());
 
+    auto const limit = joiner ? joiner->max_feats() : std::numeric_limits<size_t>::max();
     std::vector<flatbuffers::Offset<aliccp::Feature>> vfeats;
-    if (parse_feats(builder, feats, vfeats) != 0) {
+    if (parse_feats(builder, feats, limit, vfeats) != 0) {
         return -1;
     }
 
-    auto example =
-        aliccp::CreateExampleDirect(builder, example_id, y, z, feat_idx.c_str(), feat_num, &vfeats);
+    if (joiner) {
+        aliccp::CommFeature const* comm_feat;
+        auto status = joiner->lookup(feat_idx, &comm_feat);
+        if (!status.ok()) {
+            fprintf(stderr, "read comm feat %s failed: %s\n", feat_idx.c_str(), status.ToString().c_str());
+            return -1;
+        }
+        if (comm_feat) {
+            for (auto const feat : *comm_feat->feats()) {
+                if (vfeats.size() >= limit) {
+                    break;
+                }
+                vfeats.push_back(aliccp::CreateFeature(builder, feat->feat_field_id(), feat->feat_id(), feat->value()));
+            }
+        }
+    }
+
+    if (lens) {
+        // the op sees the cut record of a prejoined example, so does the length index
+        auto len = static_cast<uint32_t>(vfeats.size());
+        if (!joiner) {
+            auto comm_it = lens->comm_feat_lens.find(feat_idx);
+            if (comm_it != lens->comm_feat_lens.cend()) {
+                len += comm_it->second;
+            }
+        }
+        lens->example_lens.emplace_back(example_id, len);
+    }
+    set_bit(exists_bitmap, example_id, true);
+    set_bit(y_bitmap, example_id, y != 0);
+    set_bit(z_bitmap, example_id, z != 0);
+
+    auto example = aliccp::CreateExampleDirect(
+        builder, example_id, y, z, feat_idx.c_str(), feat_num, &vfeats, joiner != nullptr);
     builder.Finish(example);
     return 0;
 }
 
 static int
-parse_common_line(flatbuffers::FlatBufferBuilder& builder, std::string const& line, std::vector<char>& key)
+parse_common_line(flatbuffers::FlatBufferBuilder& builder,
+                  std::string const& line,
+                  LensCollector* lens,
+                  std::vector<char>& key)
 {
     std::vector<std::string> items;
     boost::split(items, line, boost::is_any_of(","));
@@ -151,18 +271,22 @@ parse_common_line(flatbuffers::FlatBufferBuilder& builder, std::string const& li
 
     std::copy(comm_feat_id.cbegin(), comm_feat_id.cend(), std::back_inserter(key));
     std::vector<flatbuffers::Offset<aliccp::Feature>> vfeats;
-    if (parse_feats(builder, feats, vfeats) != 0) {
+    if (parse_feats(builder, feats, std::numeric_limits<size_t>::max(), vfeats) != 0) {
         fprintf(stderr, "parse comm_feat feats failed. line = %s\n", feats.c_str());
         return -1;
     }
+    if (lens) {
+        lens->comm_feat_lens[comm_feat_id] = static_cast<uint32_t>(vfeats.size());
+    }
 
     auto comm_feats = aliccp::CreateCommFeatureDirect(builder, comm_feat_id.c_str(), feat_num, &vfeats);
     builder.Finish(comm_feats);
     return 0;
 }
 
+// sst files are written with the layout of the profile the dbs will be read with
 static rocksdb::Status
-open_db(const char* path, rocksdb::DB** db)
+open_db(const char* path, aliccp::DbProfile::Kind const profile, rocksdb::DB** db)
 {
     rocksdb::Options opt;
     opt.create_if_missing = true;
@@ -173,6 +297,7 @@ open_db(const char* path, rocksdb::DB** db)
     opt.compression = rocksdb::kZlibCompression;
 
     rocksdb::BlockBasedTableOptions table_opt;
+    aliccp::set_table_layout(profile, &table_opt);
     table_opt.block_cache = rocksdb::NewLRUCache(1000 * (1024 * 1024));
     table_opt.block_cache_compressed = rocksdb::NewLRUCache(500 * (1024 * 1024));
     opt.table_factory.reset(rocksdb::NewBlockBasedTableFactory(table_opt));
@@ -218,24 +343,102 @@ dump_stat_info(std::unordered_map<uint32_t, std::unordered_map<uint32_t, uint32_
     ofile.close();
 }
 
+static void
+dump_lens_index(std::vector<aliccp::LenEntry>& entries, std::string const& path)
+{
+    std::sort(entries.begin(), entries.end(), [](aliccp::LenEntry const& lhs, aliccp::LenEntry const& rhs) {
+        return lhs.example_id() < rhs.example_id();
+    });
+
+    flatbuffers::FlatBufferBuilder builder(0);
+    auto index = aliccp::CreateLenIndexDirect(builder, &entries);
+    builder.Finish(index);
+
+    auto buf = builder.GetBufferPointer();
+    auto size = builder.GetSize();
+    std::ofstream ofile(path, std::ios::binary);
+    ofile.write((char*)buf, size);
+    ofile.close();
+}
+
+static void
+dump_label_index(std::string const& path)
+{
+    y_bitmap.resize(exists_bitmap.size(), 0);
+    z_bitmap.resize(exists_bitmap.size(), 0);
+
+    flatbuffers::FlatBufferBuilder builder(0);
+    auto index = aliccp::CreateLabelIndexDirect(builder, &exists_bitmap, &y_bitmap, &z_bitmap);
+    builder.Finish(index);
+
+    auto buf = builder.GetBufferPointer();
+    auto size = builder.GetSize();
+    std::ofstream ofile(path, std::ios::binary);
+    ofile.write((char*)buf, size);
+    ofile.close();
+}
+
+// an examples db keeps one key format, new dbs record theirs
+static rocksdb::Status
+check_key_format(rocksdb::DB* db, uint32_t const key_format)
+{
+    std::unique_ptr<rocksdb::Iterator> it(db->NewIterator(rocksdb::ReadOptions()));
+    it->SeekToFirst();
+    if (!it->status().ok()) {
+        return it->status();
+    }
+    if (!it->Valid()) {
+        return aliccp::write_key_format(db, key_format);
+    }
+
+    uint32_t existing;
+    auto status = aliccp::read_key_format(db, &existing);
+    if (status.ok() && existing != key_format) {
+        status = rocksdb::Status::InvalidArgument("db has key format " + std::to_string(existing) +
+                                                  ", run migrate_keys or pass -key_format " + std::to_string(existing));
+    }
+    return status;
+}
+
+// path_to_data may be plain or gzip, tar_member picks the data out of a tar archive
 static int
 write_features_to_db(const std::string& path_to_data,
+                     const std::string& tar_member,
+                     const int decode_threads,
                      const std::string& path_to_db,
+                     aliccp::DbProfile::Kind const profile,
+                     uint32_t const key_format,
                      const int batch_size,
-                     bool const isexample)
+                     bool const isexample,
+                     CommFeatJoiner* joiner,
+                     LensCollector* lens)
 {
+    std::string err;
+    auto source = aliccp::open_input(path_to_data, tar_member, decode_threads, &err);
+    if (!source) {
+        fprintf(stderr, "open input failed: %s\n", err.c_str());
+        return -1;
+    }
+
     rocksdb::DB* db = nullptr;
-    auto status = open_db(path_to_db.c_str(), &db);
+    auto status = open_db(path_to_db.c_str(), profile, &db);
     if (!status.ok()) {
         fprintf(stderr, "open db failed: %s, msg: %s\n", path_to_db.c_str(), status.ToString().c_str());
         return -1;
     }
 
     auto pdb = std::shared_ptr<rocksdb::DB>(db);
+    if (isexample) {
+        status = check_key_format(db, key_format);
+        if (!status.ok()) {
+            fprintf(stderr, "key format of %s: %s\n", path_to_db.c_str(), status.ToString().c_str());
+            return -1;
+        }
+    }
 
     rocksdb::WriteOptions option;
 
-    std::ifstream ifs(path_to_data);
+    aliccp::LineReader reader(std::move(source));
     std::string line;
     int cnt = 0;
     flatbuffers::FlatBufferBuilder builder(0);
@@ -243,12 +446,13 @@ write_features_to_db(const std::string& path_to_data,
     auto batch = std::make_shared<rocksdb::WriteBatch>();
     auto start = time(nullptr);
     uint64_t total_size = 0;
-    while (std::getline(ifs, line)) {
+    while (reader.getline(line)) {
         std::vector<char> keybuf;
-        if (isexample) {
-            parse_skeleton_line(builder, line, keybuf);
-        } else {
-            parse_common_line(builder, line, keybuf);
+        auto const ret = isexample ? parse_skeleton_line(builder, line, key_format, joiner, lens, keybuf)
+                                   : parse_common_line(builder, line, lens, keybuf);
+        if (ret != 0) {
+            fprintf(stderr, "parse line %d of %s failed\n", cnt + 1, path_to_data.c_str());
+            return -1;
         }
 
         auto buf = builder.GetBufferSpan();
@@ -274,15 +478,30 @@ write_features_to_db(const std::string& path_to_data,
         }
     }
     if (batch->GetDataSize() > 0) pdb->Write(option, &(*batch));
+
+    err = reader.error();
+    if (!err.empty()) {
+        fprintf(stderr, "read %s failed after %d lines: %s\n", path_to_data.c_str(), cnt, err.c_str());
+        return -1;
+    }
     return 0;
 }
 
 DEFINE_string(common_data, "", "path to common feats data");
 DEFINE_string(examples_data, "", "Path to examples data");
+DEFINE_string(common_member, "", "tar member to read from common_data, e.g. common_features_train.csv");
+DEFINE_string(examples_member, "", "tar member to read from examples_data, e.g. sample_skeleton_train.csv");
 DEFINE_string(common_db, "", "Path to common feats db");
 DEFINE_string(examples_db, "", "Path to examples db");
 DEFINE_int32(batch, 10000, "batch size");
 DEFINE_string(stat, "", "path to stat flatbuffers binary");
+DEFINE_string(lens_index, "", "path to feature length index flatbuffers binary, optional");
+DEFINE_string(label_index, "", "path to y/z label bitmap flatbuffers binary, optional");
+DEFINE_int32(decode_threads, 1, "threads inflating a multi-member gzip input, e.g. bgzip output");
+DEFINE_int32(key_format, aliccp::kKeyFormatBigEndian, "example key format, 1: legacy native endian, 2: big endian");
+DEFINE_string(db_profile, "default", "sst layout, default or point_lookup, read the dbs with the same profile");
+DEFINE_bool(prejoin, false, "store every example with its comm feats so the op reads it with one lookup");
+DEFINE_int32(prejoin_max_feats, 0, "cut prejoined examples to this many feats, 0 keeps all");
 
 int
 main(int argc, char* argv[])
@@ -294,8 +513,77 @@ main(int argc, char* argv[])
         fprintf(stderr, "type, data, db are required.\n");
         return -1;
     }
+    if (FLAGS_key_format != aliccp::kKeyFormatLegacy && FLAGS_key_format != aliccp::kKeyFormatBigEndian) {
+        fprintf(stderr, "key_format must be 1 or 2\n");
+        return -1;
+    }
 
-    write_features_to_db(FLAGS_common_data, FLAGS_common_db, FLAGS_batch, false);
-    write_features_to_db(FLAGS_examples_data, FLAGS_examples_db, FLAGS_batch, true);
+    aliccp::DbProfile::Kind profile;
+    auto status = aliccp::parse_db_profile(FLAGS_db_profile, &profile);
+    if (!status.ok()) {
+        fprintf(stderr, "%s\n", status.ToString().c_str());
+        return -1;
+    }
+
+    // lengths are only collected when the index is written, prejoined examples count their own
+    // feats and need no comm feat lengths
+    std::unique_ptr<LensCollector> lens;
+    if (!FLAGS_lens_index.empty()) {
+        lens.reset(new LensCollector);
+    }
+
+    if (write_features_to_db(FLAGS_common_data,
+                             FLAGS_common_member,
+                             FLAGS_decode_threads,
+                             FLAGS_common_db,
+                             profile,
+                             FLAGS_key_format,
+                             FLAGS_batch,
+                             false,
+                             nullptr,
+                             FLAGS_prejoin ? nullptr : lens.get()) != 0) {
+        return -1;
+    }
+
+    // the comm feats db written above is read back to join every skeleton row
+    std::unique_ptr<rocksdb::DB> comm_db;
+    std::unique_ptr<CommFeatJoiner> joiner;
+    if (FLAGS_prejoin) {
+        rocksdb::DB* db = nullptr;
+        status = open_db(FLAGS_common_db.c_str(), profile, &db);
+        if (!status.ok()) {
+            fprintf(stderr, "open db failed: %s, msg: %s\n", FLAGS_common_db.c_str(), status.ToString().c_str());
+            return -1;
+        }
+        comm_db.reset(db);
+        auto const max_feats = FLAGS_prejoin_max_feats > 0 ? static_cast<size_t>(FLAGS_prejoin_max_feats)
+                                                           : std::numeric_limits<size_t>::max();
+        joiner.reset(new CommFeatJoiner(comm_db.get(), max_feats));
+    }
+
+    if (write_features_to_db(FLAGS_examples_data,
+                             FLAGS_examples_member,
+                             FLAGS_decode_threads,
+                             FLAGS_examples_db,
+                             profile,
+                             FLAGS_key_format,
+                             FLAGS_batch,
+                             true,
+                             joiner.get(),
+                             lens.get()) != 0) {
+        return -1;
+    }
+    if (joiner && joiner->misses() > 0) {
+        fprintf(stderr,
+                "%lu examples have no comm feats in %s, they are stored with their own feats only\n",
+                joiner->misses(),
+                FLAGS_common_db.c_str());
+    }
     dump_stat_info(field_stat, FLAGS_stat);
+    if (lens) {
+        dump_lens_index(lens->example_lens, FLAGS_lens_index);
+    }
+    if (!FLAGS_label_index.empty()) {
+        dump_label_index(FLAGS_label_index);
+    }
 }